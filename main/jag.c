@@ -16,6 +16,7 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include "freertos/FreeRTOS.h"
@@ -24,30 +25,103 @@
 #include "esp_eth.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "soc/cpu.h"
 
 #include "esp_freertos_hooks.h"
 #include "freertos/semphr.h"
+#include "freertos/queue.h"
 #include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_task.h"
 
 #include "screen_driver.h"
 #include "touch_panel.h"
 #include "jag.h"
+#include "spsc_ring.h"
 #include "painter_fonts.h"
 
 #define JAG_MAXPIXELS_PERLINE	1200						// the maximum number of pixels for one displayed line
+#define JAG_MAXBYTES_PERDRAW	4000						// ili9341 driver is limited to 4000ish bytes per draw_bitmap
+#define ILI9341_RAMRD		0x2E						// Memory Read command
+
+// What the flush task is asked to do
+#define JAG_FLUSH_DRAW		0						// draw a buffer
+#define JAG_FLUSH_WAIT		1						// give flush_done once everything before it is on the panel
+#define JAG_FLUSH_DIRTY		2						// send the tiles of the shadow that changed
+#define JAG_FLUSH_FILL		3						// fill x,y,w,h with color, no buffer
 
 extern const char *TAG;
 static scr_driver_t		jag_lcd_drv;
+static scr_interface_driver_t	*jag_iface	= NULL;				// SPI interface under jag_lcd_drv
+static int			jag_canread	= FALSE;			// TRUE if the SPI clock is slow enough to read GRAM
 static uint16_t			jag_width	= 0;
 static uint16_t			jag_height	= 0;
 static uint16_t			pbuf[JAG_MAXPIXELS_PERLINE];
+static uint8_t			rbuf[1+(JAG_MAXPIXELS_PERLINE*3)];		// one line read back, dummy byte then 3 bytes per pixel
+static uint16_t			cbuf[JAG_MAXBYTES_PERDRAW/sizeof(uint16_t)];	// band of lines for jag_copy_rect()
+static uint16_t			fbuf[JAG_MAXBYTES_PERDRAW/sizeof(uint16_t)];	// repeated colour for jag_fill_rect()
 SemaphoreHandle_t 		xs		= NULL;
+static uint64_t			jag_busy_us	= 0;				// time spent talking to the LCD
+static uint64_t			jag_busy_cycles	= 0;				// the same in CPU cycles, includes any byte swapping
+static uint64_t			jag_pixels	= 0;				// pixels drawn
+static uint64_t			jag_wire_pixels	= 0;				// of which were sent as they came, no swap
+static uint64_t			jag_windows	= 0;				// window setups for those pixels
+static int			jag_swapdata	= FALSE;			// TRUE if the SPI driver swaps bytes itself
+static uint16_t			sbuf[JAG_MAXBYTES_PERDRAW/sizeof(uint16_t)];	// band of pixels byte swapped for the panel
+static uint64_t			jag_stall_us	= 0;				// time callers were held up by the LCD
+
+// Flush task, owns the LCD for queued buffers so the decoder can fill the next while one is sent.  It runs
+// on JAG_FLUSH_CORE, the decoder on the other.  Empty buffers only go from the flush task to vnc_task so
+// come back through a lock free ring, flush_work stays a queue as any task drawing directly puts a wait on it
+struct jag_flush_item
+{
+	uint16_t	x;
+	uint16_t	y;
+	uint16_t	w;
+	uint16_t	h;
+	uint16_t	*buf;
+	uint16_t	color;									// JAG_FLUSH_FILL only
+	int		wire;									// TRUE if in the panels byte order
+	int		cmd;									// JAG_FLUSH_
+};
+
+static struct spsc_ring		flush_free;					// buffers ready to fill, vnc_task takes them
+static QueueHandle_t		flush_work	= NULL;				// buffers waiting to be sent
+static SemaphoreHandle_t	flush_waiting	= NULL;				// one jag_flush_wait() at a time
+static SemaphoreHandle_t	flush_done	= NULL;				// given when the wait marker is reached
+static volatile uint32_t	flush_queued	= 0;				// only written by vnc_task, buffers, fills and dirty markers
+static volatile uint32_t	flush_sent	= 0;				// only written by the flush task
+static void			(*flush_poll)()	= NULL;				// called every flush_poll_ms between buffers
+static int64_t			flush_poll_ms	= 0;
+
+// Shadow framebuffer, a copy of the display in RAM held as it is handed to the interface.  Kept in
+// strips of JAG_SHADOW_TILE lines so it does not need 150K in one block, one dirty bit per tile
+static uint16_t			**shadow	= NULL;				// NULL no shadow, draw straight to the panel
+static uint32_t			*dirty		= NULL;				// tiles that differ from the panel
+static uint16_t			dirty_tw	= 0;				// tiles across
+static uint16_t			dirty_th	= 0;				// tiles down
+static volatile int		shadow_hold	= FALSE;			// TRUE during an update, changed tiles wait for the flush task.
+										// Written by vnc_task, read by the flush task on the other core
+static uint64_t			jag_shadow_pixels = 0;				// pixels drawn into the shadow
 
 
 
-void jag_init(scr_driver_t* driver)
+static void jag_flush_init();
+static void jag_draw_bands(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t *bitmap, int swap);
+static void jag_flush_cmd(int cmd);
+static void jag_fill_locked(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t color);
+
+
+
+// iface is the SPI interface the driver was created with, canread TRUE if the bus clock allows reading the display,
+// swapdata TRUE if the interface was created with swap_data, otherwise jag puts RGB565 into the panels byte order
+void jag_init(scr_driver_t* driver, scr_interface_driver_t* iface, int canread, int swapdata)
 {
         jag_lcd_drv     = *driver;
+	jag_iface	= iface;
+	jag_canread	= canread;
+	jag_swapdata	= swapdata;
 	scr_info_t	lcd_info;
 
 	jag_lcd_drv.get_info(&lcd_info);
@@ -57,23 +131,541 @@ void jag_init(scr_driver_t* driver)
 	if (xs == NULL)
 		xs = xSemaphoreCreateMutex();
 	ESP_LOGI(TAG,"jag_init() - Screen name:%s | width:%d | height:%d", lcd_info.name, lcd_info.width, lcd_info.height);
+	jag_flush_init();
 }
 
 
 
 
-// Everything comes through here, possibly re-enterently
-void jag_draw_bitmap(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t *bitmap)
+// The ili9341 takes RGB565 high byte first, the opposite of how the ESP32 holds a uint16_t
+static inline uint16_t jag_panel_order(uint16_t c)
+{
+	if (jag_swapdata==TRUE)
+		return(c);
+	return((c>>8) | (c<<8));
+}
+
+
+
+// Send a block of pixels to the panel, call with the semaphore held.  swap TRUE if bitmap is in the ESP32s
+// byte order and has to be swapped for the panel.  The window is set once for the whole block and the pixels
+// streamed into it in transfers the SPI DMA can take, so a block of many lines costs one window setup
+static void jag_send(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t *bitmap, int swap)
 {
 	esp_err_t	ret;
+	uint16_t	*b  = NULL;
+	uint16_t	lpb = h;								// lines per draw_bitmap
+	uint16_t	l   = 0;
+	uint32_t	i   = 0;
+	uint32_t	n   = w*h;								// pixels left to send
+	uint32_t	c   = 0;
 
-	if (xSemaphoreTake( xs, ( TickType_t ) 1000/portTICK_PERIOD_MS ) == pdTRUE )	// iot display code should not need this?
+	if (n==0)
+		return;
+	if (jag_iface!=NULL)
 	{
-		ret=jag_lcd_drv.draw_bitmap(x, y, w, h, (uint16_t*)bitmap);		// Call ili9341 driver, limited to 4000ish bytes
+		jag_iface->bus_acquire(jag_iface);
+		ret = jag_lcd_drv.set_window(x, y, x+w-1, y+h-1);
+		jag_windows++;
+		while (n>0 && ret==ESP_OK)
+		{
+			c = JAG_MAXBYTES_PERDRAW/sizeof(uint16_t);				// not tied to line boundaries
+			if (c > n)
+				c = n;
+			b = bitmap;
+			if (swap==TRUE)
+			{
+				for (i=0;i<c;i++)
+					sbuf[i] = (bitmap[i]>>8) | (bitmap[i]<<8);
+				b = (uint16_t*)&sbuf;
+			}
+			ret = jag_iface->write(jag_iface, (uint8_t*)b, c*sizeof(uint16_t));
+			bitmap = bitmap + c;
+			n = n - c;
+		}
+		jag_iface->bus_release(jag_iface);
+		if (ret!=ESP_OK)
+			ESP_LOGE(TAG,"jag_send() failed %d",ret);
+		jag_pixels += w*h;
+		return;
+	}
+
+	if (w*h*sizeof(uint16_t) > JAG_MAXBYTES_PERDRAW && w>0)				// no direct bus access, draw in bands
+	{
+		lpb = JAG_MAXBYTES_PERDRAW / (w*sizeof(uint16_t));
+		if (lpb==0)
+			lpb = 1;
+	}
+	for (l=0;l<h;l=l+lpb)
+	{
+		if (lpb > h-l)
+			lpb = h-l;
+		b = bitmap+(l*w);
+		if (swap==TRUE && w<=sizeof(sbuf)/sizeof(uint16_t))
+		{
+			n = w*lpb;
+			for (i=0;i<n;i++)
+				sbuf[i] = (b[i]>>8) | (b[i]<<8);
+			b = (uint16_t*)&sbuf;
+		}
+		ret=jag_lcd_drv.draw_bitmap(x, y+l, w, lpb, b);				// Call ili9341 driver, limited to 4000ish bytes
+		jag_windows++;
 		if (ret!=ESP_OK)							// set_window failed and no data was written
 		{
 			ESP_LOGE(TAG,"draw_bitmap returned %d",ret);
 		}
+	}
+	jag_pixels += w*h;
+}
+
+
+
+// First pixel of line y of the shadow
+static inline uint16_t* shadow_line(uint16_t y)
+{
+	return(shadow[y/JAG_SHADOW_TILE] + ((y%JAG_SHADOW_TILE)*jag_width));
+}
+
+
+
+static inline void shadow_mark(uint16_t x, uint16_t y)
+{
+	uint32_t	t = ((y/JAG_SHADOW_TILE)*dirty_tw) + (x/JAG_SHADOW_TILE);
+
+	dirty[t>>5] |= 1U<<(t&31);
+}
+
+
+
+// Copy a block into the shadow a tile wide piece at a time, only tiles where a pixel changed are marked.
+// bitmap NULL fills with colour c.  Call with the semaphore held
+static void shadow_put(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t *bitmap, int swap, uint16_t c)
+{
+	uint16_t	*s = NULL;
+	uint16_t	v  = c;
+	int		cw = w;									// clipped to the display
+	int		ch = h;
+	int		changed;
+	int		i, j, k, n;
+
+	if (x>=jag_width || y>=jag_height)
+		return;
+	if (x+cw > jag_width)
+		cw = jag_width - x;
+	if (y+ch > jag_height)
+		ch = jag_height - y;
+	for (j=0;j<ch;j++)
+	{
+		s = shadow_line(y+j) + x;
+		for (i=0;i<cw;i=i+n)
+		{
+			n = JAG_SHADOW_TILE - ((x+i) % JAG_SHADOW_TILE);			// to the edge of this tile
+			if (n > cw-i)
+				n = cw-i;
+			changed = FALSE;
+			for (k=i;k<i+n;k++)
+			{
+				if (bitmap!=NULL)
+				{
+					v = bitmap[(j*w)+k];
+					if (swap==TRUE)
+						v = (v>>8) | (v<<8);
+				}
+				if (s[k]!=v)
+				{
+					s[k] = v;
+					changed = TRUE;
+				}
+			}
+			if (changed==TRUE)
+				shadow_mark(x+i, y+j);
+		}
+	}
+	jag_shadow_pixels += cw*ch;
+}
+
+
+
+// Send part of the shadow, one window for the lot, lines gathered into sbuf.  Call with the semaphore held
+static void shadow_send_rect(uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+{
+	esp_err_t	ret = ESP_OK;
+	uint16_t	lpb = (sizeof(sbuf)/sizeof(uint16_t)) / w;				// lines per transfer, a display line always fits
+	uint16_t	l   = 0;
+	uint16_t	n   = 0;
+	uint16_t	i   = 0;
+
+	if (jag_iface!=NULL)
+	{
+		jag_iface->bus_acquire(jag_iface);
+		ret = jag_lcd_drv.set_window(x, y, x+w-1, y+h-1);
+		jag_windows++;
+	}
+	for (l=0;l<h && ret==ESP_OK;l=l+n)
+	{
+		n = h-l;
+		if (n > lpb)
+			n = lpb;
+		for (i=0;i<n;i++)
+			memcpy(&sbuf[i*w], shadow_line(y+l+i)+x, w*sizeof(uint16_t));
+		if (jag_iface!=NULL)
+			ret = jag_iface->write(jag_iface, (uint8_t*)&sbuf, n*w*sizeof(uint16_t));
+		else
+		{
+			ret = jag_lcd_drv.draw_bitmap(x, y+l, w, n, (uint16_t*)&sbuf);
+			jag_windows++;
+		}
+	}
+	if (jag_iface!=NULL)
+		jag_iface->bus_release(jag_iface);
+	if (ret!=ESP_OK)
+		ESP_LOGE(TAG,"shadow_send_rect() failed %d",ret);
+	jag_pixels += w*h;
+}
+
+
+
+// Send every changed tile, a run of them along a row of tiles goes in one window.  Call with the semaphore held
+static void shadow_send()
+{
+	uint16_t	tx, ty, t0;
+	uint16_t	x, w, h;
+	uint32_t	t;
+
+	for (ty=0;ty<dirty_th;ty++)
+	{
+		tx = 0;
+		while (tx<dirty_tw)
+		{
+			t = (ty*dirty_tw) + tx;
+			if ((dirty[t>>5] & (1U<<(t&31))) == 0)
+			{
+				tx++;
+				continue;
+			}
+			t0 = tx;
+			while (tx<dirty_tw && (dirty[t>>5] & (1U<<(t&31))) != 0)
+			{
+				dirty[t>>5] &= ~(1U<<(t&31));
+				tx++;
+				t++;
+			}
+			x = t0*JAG_SHADOW_TILE;
+			w = (tx*JAG_SHADOW_TILE) - x;
+			if (x+w > jag_width)
+				w = jag_width - x;
+			h = JAG_SHADOW_TILE;
+			if ((ty*JAG_SHADOW_TILE)+h > jag_height)
+				h = jag_height - (ty*JAG_SHADOW_TILE);
+			shadow_send_rect(x, ty*JAG_SHADOW_TILE, w, h);
+		}
+	}
+}
+
+
+
+// Draw a block, into the shadow if there is one otherwise to the panel.  Call with the semaphore held
+static void jag_draw_bands(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t *bitmap, int swap)
+{
+	if (shadow==NULL)
+	{
+		jag_send(x, y, w, h, bitmap, swap);
+		return;
+	}
+	shadow_put(x, y, w, h, bitmap, swap, 0);
+	if (shadow_hold!=TRUE)
+		shadow_send();
+}
+
+
+
+// Keep a copy of the display in RAM, PSRAM if the board has it, and draw into that.  Only tiles that
+// changed are sent to the panel and reads come from RAM, so CopyRect and the cursor work without
+// panel readback.  Returns FALSE and carries on drawing straight to the panel if there is no room
+int jag_shadow_init()
+{
+	uint32_t	bytes = JAG_SHADOW_TILE*jag_width*sizeof(uint16_t);			// one strip
+	int		i = 0;
+
+	if (shadow!=NULL)
+		return(TRUE);
+	dirty_tw = (jag_width+JAG_SHADOW_TILE-1) / JAG_SHADOW_TILE;
+	dirty_th = (jag_height+JAG_SHADOW_TILE-1) / JAG_SHADOW_TILE;
+	dirty	 = calloc(((dirty_tw*dirty_th)+31)/32, sizeof(uint32_t));
+	shadow	 = calloc(dirty_th, sizeof(uint16_t*));
+	for (i=0;i<dirty_th && shadow!=NULL && dirty!=NULL;i++)
+	{
+		shadow[i] = heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM);
+		if (shadow[i]==NULL)
+			shadow[i] = heap_caps_malloc(bytes, MALLOC_CAP_8BIT);
+		if (shadow[i]==NULL)
+			break;
+		bzero(shadow[i], bytes);
+	}
+	if (shadow==NULL || dirty==NULL || i<dirty_th)
+	{
+		ESP_LOGE(TAG,"jag_shadow_init() not enough RAM for a %dx%d shadow, drawing direct", jag_width, jag_height);
+		while (shadow!=NULL && i>0)
+			free(shadow[--i]);
+		free(shadow);
+		free(dirty);
+		shadow = NULL;
+		dirty  = NULL;
+		return(FALSE);
+	}
+	memset(dirty, 0xFF, (((dirty_tw*dirty_th)+31)/32)*sizeof(uint32_t));		// panel contents unknown, the first send covers it all
+	for (i=dirty_tw*dirty_th;i<(((dirty_tw*dirty_th)+31)/32)*32;i++)		// but not tiles past the end
+		dirty[i>>5] &= ~(1U<<(i&31));
+	ESP_LOGI(TAG,"jag_shadow_init() %dx%d shadow, %d tiles", jag_width, jag_height, dirty_tw*dirty_th);
+	return(TRUE);
+}
+
+
+
+// A batch of drawing is starting, with a shadow the changed tiles are left for the flush task
+// to send when it is idle or at jag_update_end(), so a tile drawn several times goes once
+void jag_update_begin()
+{
+	shadow_hold = TRUE;
+}
+
+
+
+void jag_update_end()
+{
+	shadow_hold = FALSE;
+	if (shadow!=NULL)
+		jag_flush_cmd(JAG_FLUSH_DIRTY);
+}
+
+
+
+// Sends queued buffers to the LCD in the order they were put, returning each to the free queue once sent
+static void jag_flush_task(void *pvParameters)
+{
+	struct jag_flush_item	it;
+	int64_t		st;
+	int64_t		next = 0;							// next flush_poll() call
+	TickType_t	wait = portMAX_DELAY;
+	uint32_t	sc;
+	uint32_t	i = 0;
+
+	while (1)
+	{
+		if (flush_poll!=NULL)
+		{
+			st = esp_timer_get_time();
+			if (st >= next && xSemaphoreTake(xs, portMAX_DELAY) == pdTRUE)	// vnc_task may be reading the panel
+			{
+				flush_poll();
+				xSemaphoreGive(xs);
+				next = st + (flush_poll_ms*1000);
+			}
+			wait = (next-st) / 1000 / portTICK_PERIOD_MS;
+			if (wait < 1)
+				wait = 1;
+		}
+		if (xQueueReceive(flush_work, &it, wait) != pdTRUE)
+			continue;
+		if (it.cmd==JAG_FLUSH_FILL)
+		{
+			if (xSemaphoreTake(xs, portMAX_DELAY) == pdTRUE)
+			{
+				st = esp_timer_get_time();
+				jag_fill_locked(it.x, it.y, it.w, it.h, it.color);
+				jag_busy_us += esp_timer_get_time() - st;
+				xSemaphoreGive(xs);
+			}
+			flush_sent++;
+			continue;
+		}
+		if (it.cmd!=JAG_FLUSH_DRAW)
+		{
+			if (shadow!=NULL && (it.cmd==JAG_FLUSH_DIRTY || shadow_hold!=TRUE) &&	// mid update a wait only needs the shadow
+			    xSemaphoreTake(xs, portMAX_DELAY) == pdTRUE)
+			{
+				st = esp_timer_get_time();
+				shadow_send();
+				jag_busy_us += esp_timer_get_time() - st;
+				xSemaphoreGive(xs);
+			}
+			if (it.cmd==JAG_FLUSH_WAIT)						// everything before the marker is on the panel
+				xSemaphoreGive(flush_done);
+			else	flush_sent++;
+			continue;
+		}
+		if (it.w>0 && it.h>0)
+		{
+			if ((it.wire==TRUE) == (jag_swapdata==TRUE))				// wrong way round for the driver, swap in place
+			{
+				for (i=0;i<it.w*it.h;i++)
+					it.buf[i] = (it.buf[i]>>8) | (it.buf[i]<<8);
+			}
+			if (xSemaphoreTake(xs, portMAX_DELAY) == pdTRUE)
+			{
+				st = esp_timer_get_time();
+				sc = esp_cpu_get_ccount();
+				jag_draw_bands(it.x, it.y, it.w, it.h, it.buf, FALSE);
+				if (it.wire==TRUE && jag_swapdata!=TRUE)
+					jag_wire_pixels += it.w*it.h;
+				if (shadow!=NULL && uxQueueMessagesWaiting(flush_work)==0)	// nothing waiting, catch up on changed tiles
+					shadow_send();
+				jag_busy_cycles += (uint32_t)(esp_cpu_get_ccount() - sc);
+				jag_busy_us += esp_timer_get_time() - st;
+				xSemaphoreGive(xs);
+			}
+		}
+		flush_sent++;
+		spsc_put(&flush_free, &it.buf, portMAX_DELAY);
+	}
+}
+
+
+
+// Buffers come from DMA capable RAM so the SPI driver sends them without a bounce copy
+static void jag_flush_init()
+{
+	uint16_t	*b = NULL;
+	int		i  = 0;
+
+	if (flush_free.items!=NULL)
+		return;
+	if (spsc_init(&flush_free, 4, sizeof(uint16_t*))!=TRUE)					// at least JAG_FLUSH_BUFFERS
+		ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+	flush_work	= xQueueCreate(JAG_FLUSH_BUFFERS+2, sizeof(struct jag_flush_item));	// room for a wait and a dirty marker
+	flush_waiting	= xSemaphoreCreateMutex();
+	flush_done	= xSemaphoreCreateBinary();
+	for (i=0;i<JAG_FLUSH_BUFFERS;i++)
+	{
+		b = heap_caps_malloc(JAG_FLUSH_PIXELS*sizeof(uint16_t), MALLOC_CAP_DMA);
+		if (b==NULL)
+		{
+			ESP_LOGE(TAG,"jag_flush_init() no DMA memory for buffer %d", i);
+			ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+		}
+		spsc_put(&flush_free, &b, 0);
+	}
+	xTaskCreatePinnedToCore(jag_flush_task, "lcd_flush", 3*1024, NULL, JAG_FLUSH_PRIORITY, NULL, JAG_FLUSH_CORE);
+}
+
+
+
+// A buffer of JAG_FLUSH_PIXELS to draw into, waits while the LCD is behind
+uint16_t* jag_flush_get()
+{
+	uint16_t	*b  = NULL;
+	int64_t		st  = esp_timer_get_time();
+
+	spsc_get(&flush_free, &b, portMAX_DELAY);
+	jag_stall_us += esp_timer_get_time() - st;
+	return(b);
+}
+
+
+
+// Queue a buffer from jag_flush_get() to be drawn, wire TRUE if it holds big endian RGB565.
+// The buffer belongs to the flush task until jag_flush_get() hands it out again
+void jag_flush_put(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t *buf, int wire)
+{
+	struct jag_flush_item	it;
+
+	it.x	= x;
+	it.y	= y;
+	it.w	= w;
+	it.h	= h;
+	it.buf	= buf;
+	it.wire	= wire;
+	it.cmd	= JAG_FLUSH_DRAW;
+	flush_queued++;
+	xQueueSend(flush_work, &it, portMAX_DELAY);
+}
+
+
+
+// Give back a buffer without drawing it
+void jag_flush_cancel(uint16_t *buf)
+{
+	jag_flush_put(0, 0, 0, 0, buf, FALSE);
+}
+
+
+
+// Ask the flush task to do something other than draw a buffer
+static void jag_flush_cmd(int cmd)
+{
+	struct jag_flush_item	it;
+
+	bzero(&it, sizeof(it));
+	it.cmd = cmd;
+	if (cmd==JAG_FLUSH_DIRTY)								// counted so jag_flush_wait() waits for it, waits are not
+		flush_queued++;
+	xQueueSend(flush_work, &it, portMAX_DELAY);
+}
+
+
+
+// Queue a solid fill, drawn in order with the buffers around it
+void jag_flush_fill(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t color)
+{
+	struct jag_flush_item	it;
+
+	if (w==0 || h==0)
+		return;
+	bzero(&it, sizeof(it));
+	it.x	 = x;
+	it.y	 = y;
+	it.w	 = w;
+	it.h	 = h;
+	it.color = color;
+	it.cmd	 = JAG_FLUSH_FILL;
+	flush_queued++;
+	xQueueSend(flush_work, &it, portMAX_DELAY);
+}
+
+
+
+// Wait until everything queued is on the panel, anything that draws directly or reads back calls this first
+void jag_flush_wait()
+{
+	int64_t		st;
+
+	if (flush_work==NULL || flush_sent==flush_queued)					// nothing in flight
+		return;
+	st = esp_timer_get_time();
+	xSemaphoreTake(flush_waiting, portMAX_DELAY);
+	jag_flush_cmd(JAG_FLUSH_WAIT);
+	xSemaphoreTake(flush_done, portMAX_DELAY);
+	xSemaphoreGive(flush_waiting);
+	jag_stall_us += esp_timer_get_time() - st;
+}
+
+
+
+// Have the flush task call fn every period_ms between buffers, for a device on the same SPI bus as the panel.
+// fn is called with the semaphore held so nothing else is using the bus
+void jag_flush_poll(void (*fn)(), int period_ms)
+{
+	flush_poll_ms = period_ms;
+	flush_poll = fn;
+}
+
+
+
+// Everything comes through here, possibly re-enterently.  bitmap is RGB565 as the ESP32 holds it
+void jag_draw_bitmap(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t *bitmap)
+{
+	int64_t		st;
+	uint32_t	sc;
+
+	jag_flush_wait();
+	if (xSemaphoreTake( xs, ( TickType_t ) 1000/portTICK_PERIOD_MS ) == pdTRUE )	// iot display code should not need this?
+	{
+		st = esp_timer_get_time();
+		sc = esp_cpu_get_ccount();
+		jag_draw_bands(x, y, w, h, bitmap, jag_swapdata!=TRUE);
+		jag_busy_cycles += (uint32_t)(esp_cpu_get_ccount() - sc);
+		jag_busy_us += esp_timer_get_time() - st;
+		jag_stall_us += esp_timer_get_time() - st;
 		xSemaphoreGive(xs);
 	}
 	else ESP_LOGE(TAG,"jag_draw_bitmap() Failed to aquire semaphore");
@@ -81,18 +673,148 @@ void jag_draw_bitmap(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t *b
 
 
 
+// Read pixels back from the shadow if there is one, otherwise from the ili9341 GRAM one line at a time.
+// The panel returns 18 bit colour as 3 bytes per pixel after a dummy byte, this is packed back down
+// to RGB565.  Returns FALSE if readback is not available
+int jag_read_bitmap(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t *bitmap)
+{
+	uint8_t		cmd = ILI9341_RAMRD;
+	uint8_t		*p  = NULL;
+	uint16_t	*s  = NULL;
+	esp_err_t	ret = ESP_OK;
+	int64_t		st  = 0;
+	uint16_t	l   = 0;
+	uint16_t	i   = 0;
 
-// draw an image of any size one line at a time. Optionally copy image data first as draw_bitmap needs image in RAM not flash
+	if (shadow!=NULL)
+	{
+		if (x+w > jag_width || y+h > jag_height)
+			return(FALSE);
+		jag_flush_wait();								// queued buffers are in the shadow
+		if (xSemaphoreTake( xs, ( TickType_t ) 1000/portTICK_PERIOD_MS ) != pdTRUE )
+		{
+			ESP_LOGE(TAG,"jag_read_bitmap() Failed to aquire semaphore");
+			return(FALSE);
+		}
+		for (l=0;l<h;l++)
+		{
+			s = shadow_line(y+l) + x;
+			for (i=0;i<w;i++)
+				*bitmap++ = jag_panel_order(s[i]);				// the swap is its own inverse
+		}
+		xSemaphoreGive(xs);
+		return(TRUE);
+	}
+	if (jag_canread!=TRUE || jag_iface==NULL || w>JAG_MAXPIXELS_PERLINE)
+		return(FALSE);
+	jag_flush_wait();									// read what has been queued, not what was there
+	if (xSemaphoreTake( xs, ( TickType_t ) 1000/portTICK_PERIOD_MS ) != pdTRUE )
+	{
+		ESP_LOGE(TAG,"jag_read_bitmap() Failed to aquire semaphore");
+		return(FALSE);
+	}
+	st = esp_timer_get_time();
+	jag_iface->bus_acquire(jag_iface);
+	for (l=0;l<h && ret==ESP_OK;l++)
+	{
+		ret = jag_lcd_drv.set_window(x, y+l, x+w-1, y+l);
+		if (ret==ESP_OK)
+			ret = jag_iface->write_command(jag_iface, &cmd, 1);
+		if (ret==ESP_OK)
+			ret = jag_iface->read(jag_iface, (uint8_t*)&rbuf, 1+(w*3));
+		p = &rbuf[1];								// skip dummy byte
+		for (i=0;i<w;i++)
+		{
+			*bitmap++ = ((p[0]&0xF8)<<8) | ((p[1]&0xFC)<<3) | (p[2]>>3);
+			p = p + 3;
+		}
+	}
+	jag_iface->bus_release(jag_iface);
+	jag_busy_us += esp_timer_get_time() - st;
+	jag_stall_us += esp_timer_get_time() - st;
+	xSemaphoreGive(xs);
+	if (ret!=ESP_OK)
+	{
+		ESP_LOGE(TAG,"jag_read_bitmap() failed %d",ret);
+		return(FALSE);
+	}
+	return(TRUE);
+}
+
+
+
+// Move a rectangle of pixels already on the display, source and destination may overlap.
+// Works in bands of whole lines read back from the panel (or the shadow), bottom up when moving down so
+// a band never overwrites lines that have not been read yet.  Returns FALSE if readback is not available
+int jag_copy_rect(uint16_t sx, uint16_t sy, uint16_t dx, uint16_t dy, uint16_t w, uint16_t h)
+{
+	int	lpb = 0;									// lines per band
+	int	n   = 0;
+	int	l   = 0;
+
+	if (jag_can_read()!=TRUE || w==0 || h==0 || w>JAG_MAXPIXELS_PERLINE)
+		return(FALSE);
+	lpb = (sizeof(cbuf)/sizeof(uint16_t)) / w;
+	if (dy > sy)									// moving down, start at the bottom
+	{
+		l = h;
+		while (l>0)
+		{
+			n = lpb;
+			if (n > l)
+				n = l;
+			l = l - n;
+			if (jag_read_bitmap(sx, sy+l, w, n, (uint16_t*)&cbuf)!=TRUE)
+				return(FALSE);
+			jag_draw_bitmap(dx, dy+l, w, n, (uint16_t*)&cbuf);
+		}
+	}
+	else
+	{
+		for (l=0;l<h;l=l+n)
+		{
+			n = lpb;
+			if (n > h-l)
+				n = h-l;
+			if (jag_read_bitmap(sx, sy+l, w, n, (uint16_t*)&cbuf)!=TRUE)
+				return(FALSE);
+			jag_draw_bitmap(dx, dy+l, w, n, (uint16_t*)&cbuf);
+		}
+	}
+	return(TRUE);
+}
+
+
+
+// TRUE if what is on the display can be read back, from the panel or the shadow
+int jag_can_read()
+{
+	if (shadow!=NULL)
+		return(TRUE);
+	return(jag_canread);
+}
+
+
+
+
+// draw an image of any size as many lines at a time as fit in pbuf. Copy image data first as draw_bitmap needs image in RAM not flash
 void jag_draw_icon(uint16_t x, uint16_t y, uint16_t w, uint16_t h, const char *image)
 {
 	uint16_t	l   = 0;
+	uint16_t	n   = 0;
+	uint16_t	lpb = 1;								// lines per copy
 	uint16_t	bytesperline=0;
 
 	bytesperline = w*sizeof(uint16_t);
-	for (l=0;l<h;l++)								// for every line of image
+	if (w>0 && w<=sizeof(pbuf)/sizeof(uint16_t))
+		lpb = (sizeof(pbuf)/sizeof(uint16_t)) / w;
+	for (l=0;l<h;l=l+n)								// for every block of lines of image
 	{
-		memcpy(&pbuf, image+(bytesperline*l), bytesperline);			// copy one line of pixels from flash to RAM
-		jag_draw_bitmap(x, y+l, w, 1, (uint16_t*)&pbuf);			// draw line of pixels
+		n = h-l;
+		if (n > lpb)
+			n = lpb;
+		memcpy(&pbuf, image+(bytesperline*l), bytesperline*n);			// copy lines of pixels from flash to RAM
+		jag_draw_bitmap(x, y+l, w, n, (uint16_t*)&pbuf);			// draw lines of pixels
 	}
 }
 
@@ -100,16 +822,91 @@ void jag_draw_icon(uint16_t x, uint16_t y, uint16_t w, uint16_t h, const char *i
 
 
 
+// Fill a rectangle with one color, call with the semaphore held and nothing queued in front of it.  The
+// display window is set once and the color streamed into it, so a fill costs one window setup however
+// many lines it covers
+static void jag_fill_locked(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t color)
+{
+	esp_err_t	ret = ESP_OK;
+	uint32_t	n   = w*h;								// pixels left to send
+	uint32_t	c   = 0;
+	uint32_t	i   = 0;
+	uint32_t	px  = 0;
+	uint32_t	pw  = 0;
+
+	if (shadow!=NULL)									// only tiles that change colour are sent
+	{
+		shadow_put(x, y, w, h, NULL, FALSE, jag_panel_order(color));
+		if (shadow_hold!=TRUE)
+			shadow_send();
+		return;
+	}
+	if (jag_iface==NULL)									// no direct bus access, draw in bands
+	{
+		for (i=0;i<(sizeof(fbuf)/sizeof(uint16_t));i++)
+			fbuf[i]=color;
+		for (px=0;px<w;px=px+pw)							// columns, only if a line is wider than fbuf
+		{
+			pw = w-px;
+			if (pw > sizeof(fbuf)/sizeof(uint16_t))
+				pw = sizeof(fbuf)/sizeof(uint16_t);
+			c = (sizeof(fbuf)/sizeof(uint16_t)) / pw;				// at least one line
+			for (i=0;i<h;i=i+c)
+				jag_draw_bands(x+px, y+i, pw, (h-i < c) ? h-i : c, (uint16_t*)&fbuf, jag_swapdata!=TRUE);
+		}
+		return;
+	}
+
+	c = n;
+	if (c > sizeof(fbuf)/sizeof(uint16_t))
+		c = sizeof(fbuf)/sizeof(uint16_t);
+	for (i=0;i<c;i++)
+		fbuf[i]=jag_panel_order(color);
+	jag_iface->bus_acquire(jag_iface);
+	ret = jag_lcd_drv.set_window(x, y, x+w-1, y+h-1);
+	jag_windows++;
+	while (n>0 && ret==ESP_OK)
+	{
+		if (c > n)
+			c = n;
+		ret = jag_iface->write(jag_iface, (uint8_t*)&fbuf, c*sizeof(uint16_t));
+		n = n - c;
+	}
+	jag_iface->bus_release(jag_iface);
+	jag_pixels += w*h;
+	if (ret!=ESP_OK)
+		ESP_LOGE(TAG,"jag_fill_rect() failed %d",ret);
+}
+
+
+
+// Fill a rectangle with one color now, after anything queued
+void jag_fill_rect(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t color)
+{
+	int64_t		st  = 0;
+
+	if (w==0 || h==0)
+		return;
+	jag_flush_wait();
+	if (xSemaphoreTake( xs, ( TickType_t ) 1000/portTICK_PERIOD_MS ) != pdTRUE )
+	{
+		ESP_LOGE(TAG,"jag_fill_rect() Failed to aquire semaphore");
+		return;
+	}
+	st = esp_timer_get_time();
+	jag_fill_locked(x, y, w, h, color);
+	jag_busy_us += esp_timer_get_time() - st;
+	jag_stall_us += esp_timer_get_time() - st;
+	xSemaphoreGive(xs);
+}
+
+
+
+
 // Partially clear display, or just write N lines a color
 void jag_fill_lines(uint16_t startline, uint16_t numlines, uint16_t color)
 {
-	uint16_t	buf[JAG_MAXPIXELS_PERLINE];
-	uint16_t 	l=0;
-
-	for (l=0;l<jag_width;l++)
-		buf[l]=color;
-	for (l=startline;l<startline+numlines;l++)
-		jag_draw_bitmap(0, l, jag_width, 1, (uint16_t*)&buf);	
+	jag_fill_rect(0, startline, jag_width, numlines, color);
 }
 
 
@@ -187,6 +984,52 @@ void jag_draw_string_centered(uint16_t x, uint16_t y, char* text, const font_t *
 
 
 
+// Total microseconds spent in LCD transfers, the difference between two calls is what some drawing cost
+uint64_t jag_get_busy_us()
+{
+	return(jag_busy_us);
+}
+
+
+
+// Total microseconds callers spent waiting for the LCD, their own draws and waits for the flush task.
+// Unlike jag_get_busy_us() this leaves out transfers that overlapped with the caller doing something else
+uint64_t jag_get_stall_us()
+{
+	return(jag_stall_us);
+}
+
+
+
+// CPU cycles spent in LCD transfers, pixels drawn, how many of those went straight from the
+// network and the window setups they took, together they give the cost of drawing a full frame
+uint64_t jag_get_busy_cycles()
+{
+	return(jag_busy_cycles);
+}
+
+uint64_t jag_get_pixels()
+{
+	return(jag_pixels);
+}
+
+uint64_t jag_get_wire_pixels()
+{
+	return(jag_wire_pixels);
+}
+
+uint64_t jag_get_windows()
+{
+	return(jag_windows);
+}
+
+uint64_t jag_get_shadow_pixels()
+{
+	return(jag_shadow_pixels);
+}
+
+
+
 int jag_get_display_width()
 {
 	return(jag_width);
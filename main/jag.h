@@ -23,15 +23,41 @@
 #define TRUE                    1
 #define FALSE                   0
 
+#define JAG_FLUSH_BUFFERS	3						// one being sent, one being filled, one spare
+#define JAG_FLUSH_PIXELS	(64*64)						// a ZRLE tile
+#define JAG_SHADOW_TILE		16						// the shadow framebuffer tracks changes per tile this size
+#define JAG_FLUSH_CORE		0						// core the flush task is pinned to (with Wi-Fi), vnc_task has the other
+#define JAG_FLUSH_PRIORITY	(ESP_TASK_TCPIP_PRIO-1)				// below lwIP's tcpip task, which may run on either core
 
-void jag_init(scr_driver_t* driver);
+
+void jag_init(scr_driver_t* driver, scr_interface_driver_t* iface, int canread, int swapdata);
 void jag_draw_bitmap(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t *bitmap);
+uint16_t* jag_flush_get();
+void jag_flush_put(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t *buf, int wire);
+void jag_flush_cancel(uint16_t *buf);
+void jag_flush_fill(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t color);
+void jag_flush_wait();
+void jag_flush_poll(void (*fn)(), int period_ms);
+int  jag_shadow_init();
+void jag_update_begin();
+void jag_update_end();
+int  jag_read_bitmap(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t *bitmap);
+int  jag_copy_rect(uint16_t sx, uint16_t sy, uint16_t dx, uint16_t dy, uint16_t w, uint16_t h);
+int  jag_can_read();
 void jag_draw_icon(uint16_t x, uint16_t y, uint16_t w, uint16_t h, const char *image);
+void jag_fill_rect(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t color);
 void jag_fill_lines(uint16_t startline, uint16_t numlines, uint16_t color);
 void jag_cls(uint16_t color);
 void jag_draw_char(uint16_t x, uint16_t y, char ascii_char, const font_t *font, uint16_t bgcolor, uint16_t fgcolor);
 void jag_draw_string(uint16_t x, uint16_t y, char* text, const font_t *font, uint16_t bgcolor, uint16_t fgcolor);
 void jag_draw_string_centered(uint16_t x, uint16_t y, char* text, const font_t *font, uint16_t bgcolor, uint16_t fgcolor);
+uint64_t jag_get_busy_us();
+uint64_t jag_get_stall_us();
+uint64_t jag_get_busy_cycles();
+uint64_t jag_get_pixels();
+uint64_t jag_get_wire_pixels();
+uint64_t jag_get_windows();
+uint64_t jag_get_shadow_pixels();
 int  jag_get_display_width();
 int  jag_get_display_height();
 
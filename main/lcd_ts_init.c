@@ -27,6 +27,7 @@
 // LCD and touch screen
 #include "screen_driver.h"
 #include "touch_panel.h"
+#include "lcd_ts_init.h"
 #include "jag.h"
 
 
@@ -37,12 +38,15 @@
 
 
 // SPI Speed
-//	use 26700000 or less if you need to read back from the display
+//	use 26700000 or less if you need to read back from the display, LCD_READBACK in lcd_ts_init.h picks this
 //	32000000 is the fastest that works so far.
 //
 
-//#define SPI_SPEED_LCD_HZ	26700000	
+#if LCD_READBACK == 1
+#define SPI_SPEED_LCD_HZ	26700000	
+#else
 #define SPI_SPEED_LCD_HZ	32000000	
+#endif
 #define SPI_SPEED_TOUCH_HZ	4000000
 #define GPIO_LCDBL		4							// LCD Back light LED 
 #define GPIO_TCS		3							// GPIO Touch screen Chip select
@@ -59,6 +63,7 @@
 extern const char *TAG;
 extern scr_dir_t			rotation;
 extern scr_driver_t			lcd_drv;
+extern scr_interface_driver_t		*lcd_iface;
 extern touch_panel_driver_t		touch_drv;
 
 
@@ -148,9 +153,10 @@ void lcd_init(int w, int h)
 		.pin_num_cs = GPIO_LCDCS,
 		.pin_num_dc = GPIO_DATACMD,
 		.clk_freq   = SPI_SPEED_LCD_HZ,	
-		.swap_data  = true,
+		.swap_data  = LCD_SWAP_DATA,
 	};
 	scr_interface_create(SCREEN_IFACE_SPI, &spi_lcd_cfg, &iface_drv);
+	lcd_iface = iface_drv;						// jag talks to the bus directly for fills and readback
     
 	scr_controller_config_t lcd_cfg = 
 	{
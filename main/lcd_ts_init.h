@@ -28,6 +28,20 @@
 #include "touch_panel.h"
 
 
+// SPI Max speed is 26.7Mhz if you wish to read pixels back from the display as well as write them.
+// 1 lets VNC CopyRect and the local cursor use pixels already on the panel, but every other write is
+// about 17% slower than at the 32Mhz write only clock.  LCD_SHADOW gives both without the slower clock
+#define LCD_READBACK		0
+
+// The ili9341 takes RGB565 high byte first.  1 has the SPI driver swap every pixel on the way out,
+// with 0 jag swaps what it draws itself and big endian pixels from the VNC server go to DMA as they are
+#define LCD_SWAP_DATA		0
+
+// 1 keeps a copy of the display in RAM (PSRAM if fitted, 150K at 240x320) that VNC decodes into, only
+// 16x16 tiles that changed are sent to the panel.  CopyRect and the cursor then work without readback
+#define LCD_SHADOW		0
+
+
 void lcd_ts_rotate(scr_dir_t r);
 void led_pwm_set(int b);
 void lcd_init(int w, int h);
@@ -30,6 +30,7 @@
 #include "esp_freertos_hooks.h"
 #include "freertos/semphr.h"
 #include "esp_system.h"
+#include "esp_task.h"
 
 #include "screen_driver.h"
 #include "touch_panel.h"
@@ -37,6 +38,7 @@
 #include "esp_netif.h"
 #include "lwip/err.h"
 #include "lwip/sockets.h"
+#include "esp_timer.h"
 #include <time.h>
 
 #include "global.h"
@@ -44,10 +46,24 @@
 #include "lcd_ts_init.h"
 #include "lcd_vncc.h"
 #include "jag.h"
+#include "vncc_rx.h"
+#include "esp32/rom/miniz.h"
+#include "vncc_stats.h"
+#include "vncc_inflate.h"
+#include "vncc_cursor.h"
+#include "vncc_decode.h"
+#include "vncc_pace.h"
+#include "spsc_ring.h"
 #include "endian.h"
 
 extern touch_panel_driver_t	touch_drv;
 
+struct vncc_touch										// a press read by the flush task
+{
+	uint16_t	x;
+	uint16_t	y;
+};
+
 static char		vncc_rxbuf[2048];
 static char		vncc_txbuf[512];
 char 			vncc_host_ip[22];
@@ -59,25 +75,83 @@ extern int 		backlight;
 static int		vncc_sock		= -1;
 static int		vncc_state 		= VNCC_NOT_CONNECTED;
 static int		vncc_taskcreated	= FALSE;
-static int		vncc_busy 		= FALSE;						// communicate between tasks
-static int		vncc_update_rate_hz 	= 50;
+static int		vncc_update_rate_hz 	= 50;						// touch panel reads per second, requests are paced by vncc_pace.c
+static int64_t		vncc_touch_next		= 0;						// time to look for touches again
+static struct spsc_ring	vncc_touches;								// presses from the flush task to vnc_task
+static int64_t		vncc_lastprint		= 0;
+static volatile int	vncc_reconnect		= FALSE;					// vncc_connect() asked for a new server
 static int		did_draw		= FALSE;						// true the moment we draw some pixels
 int			vncc_screennum		= 1;
 int			vncc_port		= 0;
 char x4='4';
 
+// Encodings offered to the server, most preferred first.  RAW is always offered last.
+// Set an entry to FALSE to compare it against RAW using the counters from vncc_stats_print()
+static struct vncc_encoding
+{
+	int32_t		encoding_type;
+	int		enabled;
+} vncc_encodings[] =
+{
+	{ VNC_ET_COPYRECT,	TRUE	},							// only if jag can read back the panel
+	{ VNC_ET_TRLE,		TRUE	},							// least CPU per byte saved
+	{ VNC_ET_TIGHT,		TRUE	},
+	{ VNC_ET_ZRLE,		TRUE	},
+	{ VNC_ET_ZLIB,		TRUE	},
+	{ VNC_ET_HEXTILE,	TRUE	},
+	{ VNC_ET_CORRE,		TRUE	},
+	{ VNC_ET_RRE,		TRUE	},
+	{ VNC_ET_CURSOR,	TRUE	},							// pointer drawn here, needs readback too
+	{ VNC_ET_POINTERPOS,	TRUE	},
+	{ VNC_ET_EXTENDEDDESKTOPSIZE, TRUE },							// server resized to fit the panel
+	{ VNC_ET_DESKTOPSIZE,	TRUE	},
+	{ VNC_ET_CONTINUOUSUPDATES, TRUE },							// server pushes updates, needs Fence too
+	{ VNC_ET_FENCE,		TRUE	},
+};
+
+// zlib level asked of the server for Tight and ZRLE, 0 costs it least CPU, 9 sends fewest bytes.
+// Decoding cost here hardly changes with level.  -1 leaves it to the server
+static int		vncc_compress_level	= 6;
+
+// JPEG quality asked of the server for Tight, 0 fewest bytes to 9 best picture.  -1 asks for no JPEG
+// so everything stays lossless, photos and video then cost many more bytes
+static int		vncc_quality_level	= 6;
+
+// Pixel format asked of the server.  VNCC_PF_RGB565 is big endian RGB565, the byte order the panel
+// takes, so RAW and Zlib pixels go to the SPI DMA untouched.  VNCC_PF_BGR233 halves the bytes of RGB565 at the cost of
+// colour, for when the link rather than the SPI bus limits the frame rate.  VNCC_PF_COLOURMAP is
+// also one byte per pixel but with the servers own 256 colours, exact for a PseudoColor server.
+// vncc_dither TRUE dithers 8 bit true colour RAW and Zlib rectangles
+static int		vncc_pixel_fmt		= VNCC_PF_RGB565;
+static int		vncc_dither		= FALSE;
+
+static int		vncc_resize_asked	= FALSE;					// sent SetDesktopSize this connection
+
+// ContinuousUpdates replaces polling with FramebufferUpdateRequests only if the server does
+// Fence as well, answering its fences after the rectangles before them are drawn is what stops
+// it sending faster than the panel can be written
+static int		vncc_cu_supported	= FALSE;
+static int		vncc_fence_supported	= FALSE;
+static int		vncc_cu_enabled		= FALSE;					// vncc_service() stops polling
+
+// While polling vncc_service() keeps VNCC_REQUESTS_INFLIGHT FramebufferUpdateRequests outstanding.  One
+// counts as answered as soon as the FramebufferUpdate header is read, vncc_service() runs whenever a read
+// waits, so the next request is on its way while this update is still being received and drawn
+#define VNCC_REQUESTS_INFLIGHT		1
+static int		vncc_inflight		= 0;						// requests not yet answered
+static int		vncc_in_update		= FALSE;					// vnc_task is drawing a FramebufferUpdate
+
+static struct vncc_inflate vncc_zlib;								// Zlib encoding stream, lasts the connection
 struct vnc_ServerInit	vncc_si;									// Keep a copy for reference
 char			si_name[32];
 char x5='5';
 
 
+// Only vnc_task calls this, a failed read and a failed send can both get here so a second call does nothing
 void vncc_shutdown()
 {
-	static int inprogress=FALSE;									// Multiple tasks can call us
-
-	if (inprogress==TRUE)										// function already in progress?
-		return;											// then skip it
-	inprogress = TRUE;
+	if (vncc_sock<0 && vncc_state==VNCC_NOT_CONNECTED)
+		return;
 	if (vncc_sock >0)										// still connected ?
 	{
 		shutdown(vncc_sock, 0);									// tell host we are leaving
@@ -86,49 +160,35 @@ void vncc_shutdown()
 	}
 	close(vncc_sock);
 	vncc_sock = -1;
+	vncc_rx_reset(-1);
 	vncc_state = VNCC_NOT_CONNECTED;
-	inprogress = FALSE;
 }
 
 
 
-// Read n bytes from socket(fd) into buf b with persistant tries for when sockets is giving short reads
-int readbytes(int fd, char*buf , int n)
+// Protocol state back to how it is before the greeting, for a connection or a replay
+static void vncc_session_reset()
 {
-	int bytesread=0;
-	int bytestoread=0;
-	int cs=512;											// chunk size
-	int len=0;
-
-	if (fd<0)
-		return(-1);
-	bytestoread=n;
-	if (n<cs)											// reading less than chunk size?
-		cs=n;											// try and read it all in one go
-	do
-	{
-		len = recv(fd, buf+bytesread, cs, 0);
-		if (len<0)										// socket read error ?
-		{
-			vncc_shutdown();
-			return(-1);
-		}
-		if (len>0)
-		{
-			if (len<cs)									// read less than expected
-				vTaskDelay(10 / portTICK_PERIOD_MS);					// yeild to let buffer fill
-			bytesread = bytesread + len;
-			bytestoread = bytestoread - len;
-		}
-		if (bytestoread < cs)									// last bit ?
-			cs=bytestoread;									// then do one read that size
-	} while (bytestoread > 0);
-	return(n);
+	struct vncc_touch	t;
+
+	vncc_stats_reset();
+	vncc_zrle_free();									// each connection starts new zlib streams
+	vncc_tight_free();
+	vncc_inflate_free(&vncc_zlib);
+	vncc_cursor_reset();
+	vncc_resize_asked = FALSE;
+	vncc_cu_supported = FALSE;
+	vncc_fence_supported = FALSE;
+	vncc_cu_enabled = FALSE;
+	vncc_inflight = 0;
+	vncc_in_update = FALSE;
+	vncc_pace_reset();
+	while (spsc_get(&vncc_touches, &t, 0)==TRUE)						// touched before we were connected
+		;
 }
 
 
 
-
 void vncc_doconnect()
 {
         struct sockaddr_in dest_addr;
@@ -136,6 +196,7 @@ void vncc_doconnect()
 	int ip_protocol = 0;
 	char st[64];
 
+	vncc_reconnect = FALSE;									// this is the new one
 	vncc_port = 5900+vncc_screennum;
         dest_addr.sin_addr.s_addr = inet_addr(vncc_host_ip);
         dest_addr.sin_family = AF_INET;
@@ -165,6 +226,9 @@ void vncc_doconnect()
 		vncc_sock=-1;
 		return;
         }
+	fcntl(vncc_sock, F_SETFL, fcntl(vncc_sock, F_GETFL, 0) | O_NONBLOCK);		// vncc_rx.c waits in select()
+	vncc_rx_reset(vncc_sock);								// fresh receive buffer for this connection
+	vncc_session_reset();
 }
 
 
@@ -194,6 +258,7 @@ void print_si(struct vnc_ServerInit* si)
 void process_server_init(struct vnc_ServerInit* si)
 {
 	int len=0;
+	int n=0;
 
 	si->fbwidth	= bswap16(si->fbwidth);
 	si->fbheight	= bswap16(si->fbheight);
@@ -202,10 +267,14 @@ void process_server_init(struct vnc_ServerInit* si)
 	si->pf_maxgreen	= bswap16(si->pf_maxgreen);
 	si->pf_maxblue	= bswap16(si->pf_maxblue);
 	memcpy((struct vnc_ServerInit*)&vncc_si, si, sizeof(struct vnc_ServerInit));		// Use the copy from now on
+	vncc_pixel_format(FALSE);
 
 	bzero(&vncc_rxbuf,sizeof(vncc_rxbuf));
-	len = readbytes(vncc_sock, (char*)&vncc_rxbuf, vncc_si.namelen);			// Read remainder of server_init
-	if (len==vncc_si.namelen)
+	n = vncc_si.namelen;
+	if (n > sizeof(vncc_rxbuf)-1)								// keep the start of very long names
+		n = sizeof(vncc_rxbuf)-1;
+	len = vncc_rx_read((char*)&vncc_rxbuf, n);					// Read remainder of server_init
+	if (len==n && vncc_rx_skip(vncc_si.namelen-n)>=0)
 	{
 		printf("read name, got %d bytes\n",len);
 		strncpy((char*)&si_name, (char*)&vncc_rxbuf, sizeof(si_name));
@@ -217,6 +286,23 @@ void process_server_init(struct vnc_ServerInit* si)
 
 
 
+// The part of the server framebuffer we show, all of it unless it is bigger than the panel
+static int vncc_view_width()
+{
+	if (vncc_si.fbwidth < jag_get_display_width())
+		return(vncc_si.fbwidth);
+	return(jag_get_display_width());
+}
+
+static int vncc_view_height()
+{
+	if (vncc_si.fbheight < jag_get_display_height())
+		return(vncc_si.fbheight);
+	return(jag_get_display_height());
+}
+
+
+
 // Ask server for a message about part of its frame buffer
 static void vncc_send_framebuffer_update_request(int x, int y, int w, int h, uint8_t increm)
 {
@@ -230,13 +316,67 @@ static void vncc_send_framebuffer_update_request(int x, int y, int w, int h, uin
 	fbur.ypos		= bswap16(y);
 	fbur.width		= bswap16(w);
 	fbur.height		= bswap16(h);
-	len = send(vncc_sock, (char*)&fbur, sizeof(struct vnc_FramebufferUpdateRequest), 0);	// Ask for some pixels
+	len = vncc_tx_send((char*)&fbur, sizeof(struct vnc_FramebufferUpdateRequest));	// Ask for some pixels
 	if (len!=sizeof(struct vnc_FramebufferUpdateRequest))
 	{
-		ESP_LOGE(TAG,"Got %d on send()  vncc_sock=%d",len,vncc_sock);
-		vncc_busy = TRUE;
+		ESP_LOGE(TAG,"Got %d on vncc_tx_send()  vncc_sock=%d",len,vncc_sock);
 		vncc_shutdown();
+		return;
 	}
+	vncc_inflight++;
+	vncc_pace_request();
+	vncc_stats.requests++;
+	if (vncc_in_update==TRUE)
+		vncc_stats.pipelined++;
+}
+
+
+
+// A FramebufferUpdate has arrived for one of our requests, or with reset TRUE the count can no longer
+// be trusted (stream drained, server stopped pushing).  Either way vncc_service() asks for more
+static void vncc_request_answered(int reset)
+{
+	if (reset==TRUE)
+		vncc_inflight = 0;
+	else if (vncc_inflight>0)								// a pushed update answers nothing
+		vncc_inflight--;
+	if (reset!=TRUE)
+		vncc_pace_answered();
+}
+
+
+
+// Ask the server to push changes to the part of the framebuffer we show
+static void vncc_send_enable_continuous_updates(uint8_t enable)
+{
+	struct vnc_EnableContinuousUpdates	ecu;
+	int len=0;
+
+	ecu.msg_type		= VNC_CMT_ENABLECONTINUOUSUPDATES;
+	ecu.enable		= enable;
+	ecu.xpos		= 0;
+	ecu.ypos		= 0;
+	ecu.width		= bswap16(vncc_view_width());
+	ecu.height		= bswap16(vncc_view_height());
+	len = vncc_tx_send((char*)&ecu, sizeof(struct vnc_EnableContinuousUpdates));
+	if (len!=sizeof(struct vnc_EnableContinuousUpdates))
+	{
+		ESP_LOGE(TAG,"vncc_send_enable_continuous_updates() - expected %d got %d",sizeof(struct vnc_EnableContinuousUpdates), len);
+		vncc_shutdown();
+		return;
+	}
+	vncc_cu_enabled = enable;
+	vncc_stats.cu_enabled = enable;
+	ESP_LOGI(TAG,"Continuous updates %s %dx%d", enable ? "enabled" : "disabled", vncc_view_width(), vncc_view_height());
+}
+
+
+
+// Once the server has shown it does both, stop polling
+static void vncc_try_continuous_updates()
+{
+	if (vncc_cu_supported==TRUE && vncc_fence_supported==TRUE && vncc_cu_enabled!=TRUE)
+		vncc_send_enable_continuous_updates(1);
 }
 
 
@@ -249,7 +389,8 @@ void vncc_send_pointer_event(uint16_t x, uint16_t y, uint8_t msk)
 	pev.button_mask	= msk;
 	pev.xpos	= bswap16(x);
 	pev.ypos	= bswap16(y);
-	len = send(vncc_sock, (char*)&pev, sizeof(struct vnc_PointerEvent), 0);
+	vncc_cursor_move(x, y);									// no round trip to see it move
+	len = vncc_tx_send((char*)&pev, sizeof(struct vnc_PointerEvent));
 	if (len!=sizeof(struct vnc_PointerEvent))
 	{
 		ESP_LOGE(TAG,"vncc_send_pointer_event() - expected %d got %d",sizeof(struct vnc_PointerEvent), len);
@@ -259,31 +400,229 @@ void vncc_send_pointer_event(uint16_t x, uint16_t y, uint8_t msk)
 
 
 
-void vncc_send_setencodings()
+// Ask the server to make its framebuffer the size of the panel, only once per connection so a
+// server that picks a different size is not asked forever
+static void vncc_send_setdesktopsize(struct vnc_screen *scr)
 {
-	struct	vnc_SetEncodings	se;
-	struct  vnc_send_encoding_type	et;
-	int 	len=0;
+	struct	vnc_SetDesktopSize	sds;
+	int	len=0;
 
-	se.msg_type = VNC_CMT_SETENCODINGS; 
-	se.padding = 0;
-	se.number_of_encodings = bswap16(1);							// List of 1 at the moment	
-	len = send(vncc_sock, (char*)&se, sizeof(struct vnc_SetEncodings), 0);
-	if (len!=sizeof(struct vnc_SetEncodings))
+	vncc_resize_asked = TRUE;
+	sds.msg_type		= VNC_CMT_SETDESKTOPSIZE;
+	sds.padding		= 0;
+	sds.width		= bswap16(jag_get_display_width());
+	sds.height		= bswap16(jag_get_display_height());
+	sds.number_of_screens	= 1;
+	sds.padding2		= 0;
+	sds.screen.id		= scr->id;						// keep the servers screen id and flags
+	sds.screen.xpos		= 0;
+	sds.screen.ypos		= 0;
+	sds.screen.width	= sds.width;
+	sds.screen.height	= sds.height;
+	sds.screen.flags	= scr->flags;
+	len = vncc_tx_send((char*)&sds, sizeof(struct vnc_SetDesktopSize));
+	if (len!=sizeof(struct vnc_SetDesktopSize))
 	{
-		ESP_LOGE(TAG,"vncc_send_setencodings() se - expected %d got %d",sizeof(struct vnc_SetEncodings), len); 
+		ESP_LOGE(TAG,"vncc_send_setdesktopsize() - expected %d got %d",sizeof(struct vnc_SetDesktopSize), len);
 		vncc_shutdown();
 		return;
 	}
+	ESP_LOGI(TAG,"Sent SetDesktopSize %dx%d", jag_get_display_width(), jag_get_display_height());
+}
+
+
+
+// The server framebuffer is now w x h, clear the panel and ask for all of it again
+static void vncc_desktop_resized(int w, int h)
+{
+	if (w==vncc_si.fbwidth && h==vncc_si.fbheight)
+		return;
+	ESP_LOGI(TAG,"Server framebuffer resized from %dx%d to %dx%d", vncc_si.fbwidth, vncc_si.fbheight, w, h);
+	vncc_si.fbwidth  = w;
+	vncc_si.fbheight = h;
+	if (w < jag_get_display_width() || h < jag_get_display_height())
+	{
+		jag_cls(0);									// nothing will be drawn past the new edge
+		vncc_cursor_lost();								// so what was under the pointer has gone
+	}
+	if (vncc_cu_enabled==TRUE)
+		vncc_send_enable_continuous_updates(1);						// new area
+	vncc_send_framebuffer_update_request(0, 0, vncc_view_width(), vncc_view_height(), 0);
+}
+
 
-	et.encoding_type = bswap32(VNC_ET_RAW);							// Send the list of 1
-	len = send(vncc_sock, (char*)&et, sizeof(struct vnc_send_encoding_type), 0);
-	if (len!=sizeof(struct vnc_SetEncodings))
+
+// ExtendedDesktopSize pseudo rectangle, also sent once by the server to show it supports SetDesktopSize
+static int vncc_process_extendeddesktopsize(struct vnc_rect *rec)
+{
+	struct vnc_ExtendedDesktopSize	eds;
+	struct vnc_screen		scr;
+	struct vnc_screen		first;
+	int				i = 0;
+
+	if (vncc_rx_read((char*)&eds, sizeof(eds)) != sizeof(eds))
+		return(-1);
+	for (i=0;i<eds.number_of_screens;i++)
 	{
-		ESP_LOGE(TAG,"vncc_send_setencodings() et - expected %d got %d",sizeof(struct vnc_SetEncodings), len); 
+		if (vncc_rx_read((char*)&scr, sizeof(scr)) != sizeof(scr))
+			return(-1);
+		if (i==0)
+			memcpy(&first, &scr, sizeof(scr));
+	}
+	if (rec->xpos==VNC_EDS_REASON_CLIENT && rec->ypos!=0)
+	{
+		ESP_LOGE(TAG,"Server refused SetDesktopSize, status %d", rec->ypos);
+		return(0);
+	}
+	vncc_desktop_resized(rec->width, rec->height);
+	if (eds.number_of_screens>0 && vncc_resize_asked!=TRUE &&
+	    (rec->width!=jag_get_display_width() || rec->height!=jag_get_display_height()))
+		vncc_send_setdesktopsize(&first);
+	return(0);
+}
+
+
+
+// Ask the server to send pixels in another format, from the next FramebufferUpdate on
+static void vncc_send_setpixelformat(struct vnc_PixelFormat *pf)
+{
+	struct	vnc_SetPixelFormat	spf;
+	int	len=0;
+
+	spf.msg_type		= VNC_CMT_SETPIXELFORMAT;
+	memset(&spf.padding, 0, sizeof(spf.padding));
+	memcpy(&spf.pf, pf, sizeof(struct vnc_PixelFormat));
+	spf.pf.maxred		= bswap16(pf->maxred);
+	spf.pf.maxgreen		= bswap16(pf->maxgreen);
+	spf.pf.maxblue		= bswap16(pf->maxblue);
+	len = vncc_tx_send((char*)&spf, sizeof(struct vnc_SetPixelFormat));
+	if (len!=sizeof(struct vnc_SetPixelFormat))
+	{
+		ESP_LOGE(TAG,"vncc_send_setpixelformat() - expected %d got %d",sizeof(struct vnc_SetPixelFormat), len);
+		vncc_shutdown();
+		return;
+	}
+	vncc_si.pf_bpp		= pf->bpp;
+	vncc_si.pf_depth	= pf->depth;
+	vncc_si.pf_bigendian	= pf->bigendian;
+	vncc_si.pf_truecolor	= pf->truecolor;
+	vncc_si.pf_maxred	= pf->maxred;
+	vncc_si.pf_maxgreen	= pf->maxgreen;
+	vncc_si.pf_maxblue	= pf->maxblue;
+	vncc_si.pf_shiftred	= pf->shiftred;
+	vncc_si.pf_shiftgreen	= pf->shiftgreen;
+	vncc_si.pf_shiftblue	= pf->shiftblue;
+	vncc_pixel_format(vncc_dither);
+}
+
+
+
+// Pick the pixel format from vncc_pixel_fmt, before any update is asked for
+static void vncc_choose_pixelformat()
+{
+	struct vnc_PixelFormat	pf;
+
+	memset(&pf, 0, sizeof(pf));
+	switch (vncc_pixel_fmt)
+	{
+		case VNCC_PF_BGR233:
+			pf.bpp		= 8;
+			pf.depth	= 8;
+			pf.truecolor	= 1;
+			pf.maxred	= 7;
+			pf.maxgreen	= 7;
+			pf.maxblue	= 3;
+			pf.shiftred	= 0;
+			pf.shiftgreen	= 3;
+			pf.shiftblue	= 6;
+			vncc_send_setpixelformat(&pf);
+		break;
+
+		case VNCC_PF_RGB565:
+			pf.bpp		= 16;
+			pf.depth	= 16;
+			pf.bigendian	= 1;
+			pf.truecolor	= 1;
+			pf.maxred	= 31;
+			pf.maxgreen	= 63;
+			pf.maxblue	= 31;
+			pf.shiftred	= 11;
+			pf.shiftgreen	= 5;
+			pf.shiftblue	= 0;
+			vncc_send_setpixelformat(&pf);
+		break;
+
+		case VNCC_PF_COLOURMAP:								// server follows with SetColourMapEntries
+			pf.bpp		= 8;
+			pf.depth	= 8;
+			vncc_send_setpixelformat(&pf);
+		break;
+	}
+}
+
+
+
+// zlib streams an encoding may keep for the whole connection, about 43K each (vncc_inflate.c)
+static int vncc_encoding_streams(int32_t encoding_type)
+{
+	switch (encoding_type)
+	{
+		case VNC_ET_TIGHT:
+			return(4);								// the server picks any of four
+		case VNC_ET_ZRLE:
+		case VNC_ET_ZLIB:
+			return(1);
+	}
+	return(0);
+}
+
+
+
+// Tell the server which encodings we can decode, SetEncodings header and list go in one vncc_tx_send().
+// Zlib based encodings are only offered while the heap has room for every stream of those offered
+void vncc_send_setencodings()
+{
+	struct	vnc_SetEncodings	*se = (struct vnc_SetEncodings*)&vncc_txbuf;
+	int32_t				*et = (int32_t*)&vncc_txbuf[sizeof(struct vnc_SetEncodings)];
+	int 				len = 0;
+	int				n   = 0;
+	int				i   = 0;
+	int				s   = 0;
+	int				room = vncc_inflate_room();			// the streams are freed before each connection
+
+	for (i=0;i<sizeof(vncc_encodings)/sizeof(struct vncc_encoding);i++)
+	{
+		if (vncc_encodings[i].enabled != TRUE)
+			continue;
+		if (jag_can_read()!=TRUE && (vncc_encodings[i].encoding_type==VNC_ET_COPYRECT ||
+		    vncc_encodings[i].encoding_type==VNC_ET_CURSOR || vncc_encodings[i].encoding_type==VNC_ET_POINTERPOS))
+			continue;
+		s = vncc_encoding_streams(vncc_encodings[i].encoding_type);
+		if (s > room)
+		{
+			ESP_LOGE(TAG,"vncc_send_setencodings() not offering %d, heap for %d more zlib streams", vncc_encodings[i].encoding_type, room);
+			continue;
+		}
+		room = room - s;
+		et[n++] = bswap32(vncc_encodings[i].encoding_type);
+	}
+	et[n++] = bswap32(VNC_ET_RAW);
+	if (vncc_compress_level>=0 && vncc_compress_level<=9)
+		et[n++] = bswap32(VNC_ET_COMPRESSLEVEL0 + vncc_compress_level);
+	if (vncc_quality_level>=0 && vncc_quality_level<=9)
+		et[n++] = bswap32(VNC_ET_QUALITYLEVEL0 + vncc_quality_level);
+
+	se->msg_type = VNC_CMT_SETENCODINGS; 
+	se->padding = 0;
+	se->number_of_encodings = bswap16(n);
+	len = sizeof(struct vnc_SetEncodings) + (n*sizeof(int32_t));
+	if (vncc_tx_send((char*)&vncc_txbuf, len) != len)
+	{
+		ESP_LOGE(TAG,"vncc_send_setencodings() - failed to send %d bytes", len); 
 		vncc_shutdown();
 		return;
 	}
+	printf("Sent SetEncodings, %d encodings\n", n);
 }
 
 
@@ -294,24 +633,34 @@ static void vncc_drain(char *s)
 {
 	int len=0;
 
-	vncc_busy = TRUE;									// Dont ask for more data now!
-	do
-	{
-		len = recv(vncc_sock, (char*)&vncc_rxbuf, sizeof(vncc_rxbuf), MSG_PEEK | MSG_DONTWAIT);
-		//printf("peek len=%d\n",len);
-		if (len>0)
-		{
-			len = recv(vncc_sock, (char*)&vncc_rxbuf, len, 0);
-			ESP_LOGE(TAG,"from[%s] Throwing away %d bytes", s, len);
-		}
-	} while (len>0);
-	vncc_busy = FALSE;
+	len = vncc_rx_drain();
+	if (len>0)
+		ESP_LOGE(TAG,"from[%s] Throwing away %d bytes", s, len);
+	vncc_request_answered(TRUE);								// the update asked for may have gone with it
 }
 
 
 
 
-static uint16_t		pixels[2048];
+// Lines of w pixels that fit in a flush buffer once converted, 8 bit pixels grow to 16 and 32 bit
+// ones are read in full before they shrink
+static int vncc_lines_per_buffer(int w)
+{
+	int	bpp = vncc_bpp;
+	int	lpb = 0;
+
+	if (bpp < sizeof(uint16_t))
+		bpp = sizeof(uint16_t);
+	if (w==0)
+		return(1);
+	lpb = (JAG_FLUSH_PIXELS*sizeof(uint16_t)) / (w*bpp);
+	if (lpb==0)
+		lpb = 1;
+	return(lpb);
+}
+
+
+
 void vncc_process_rectangle(int r)
 {
 	struct		vnc_rect	rec;
@@ -320,13 +669,24 @@ void vncc_process_rectangle(int r)
 	uint32_t	tms;										// time in millliseconds
 	int		len = 0;
 	int		l   = 0;
+	int		n   = 0;									// lines in this flush buffer
+	int		lpb = 0;									// lines per flush buffer
 	int		dw  = 0;									// display width
 	int		dh  = 0; 									// display height
-	static int po = 0;										// Pixels offset, either 0 or 1024
+	uint16_t	*pixels = NULL;									// flush buffer, sent while the next line is read
+	int64_t		sus = 0;									// start time, microseconds
+	uint32_t	spos = 0;									// stream position at start of rectangle
+	uint64_t	swait = 0;									// network wait total at start
+	uint64_t	slcd = 0;									// time held up by the LCD at start
+	int		err = 0;
+	uint32_t	zlen = 0;									// Zlib compressed length
 
         sclock = (uint32_t)clock();									// Default clock is 10ms resolution
-	vncc_busy = TRUE;
-	len = readbytes(vncc_sock, (char*)&rec, sizeof(struct vnc_rect));				// Get VNC rectange header
+	sus = esp_timer_get_time();
+	spos = vncc_rx_position();
+	swait = vncc_stats.rx_wait_us;
+	slcd = jag_get_stall_us();
+	len = vncc_rx_read((char*)&rec, sizeof(struct vnc_rect));				// Get VNC rectange header
 	if (len==sizeof(struct vnc_rect))
 	{
 		rec.xpos		= bswap16(rec.xpos);
@@ -343,7 +703,8 @@ void vncc_process_rectangle(int r)
 			rec.xpos, rec.ypos, rec.width, rec.height, rec.encoding_type);
 		dw = jag_get_display_width();								// Check requested rectangle fits on display
 		dh = jag_get_display_height();
-		if (rec.width > dw || rec.height >dh || rec.xpos+rec.width >dw || rec.ypos+rec.height >dh)
+		if (rec.encoding_type>=0 &&								// pseudo encodings are not pixels
+		    (rec.width > dw || rec.height >dh || rec.xpos+rec.width >dw || rec.ypos+rec.height >dh))
 		{
 			ESP_LOGE(TAG,"vncc_process_rectangle() Rectange larger than or clips display dimensions %d x %d",dw,dh);
 			vncc_drain("process_rectangle");
@@ -351,38 +712,99 @@ void vncc_process_rectangle(int r)
 		}
 
 		did_draw=TRUE;										// We did draw something on the LCD
+		if (rec.encoding_type>=0)
+			vncc_cursor_rect(&rec);							// take the pointer off if in the way
 		switch (rec.encoding_type)
 		{
-			// Read and process data one line at a time, we do not have enough RAM to read an entire framebuffer
+			// Read and process as many lines as fill a flush buffer, we do not have enough RAM to read an entire framebuffer
 			case VNC_ET_RAW:								// 0x0000
-				for (l=0;l<rec.height;l++)						// for each line of the rectangle
+				lpb = vncc_lines_per_buffer(rec.width);
+				for (l=0;l<rec.height && err==0;l=l+n)
 				{
-					if (po==0)
-						po=1024;
-					else	po=0;							// Toggle between 0 and 1024
-					readbytes(vncc_sock, (char*)&pixels[po], rec.width*2);		// read one lines worth of pixel data
-					jag_draw_bitmap(rec.xpos, rec.ypos+l, rec.width, 1, (uint16_t*)&pixels[po]);
+					n = rec.height-l;
+					if (n > lpb)
+						n = lpb;
+					pixels = jag_flush_get();					// waits only if the LCD is behind
+					if (vncc_rx_read((char*)pixels, n*rec.width*vncc_bpp) < 0)	// read n lines worth of pixel data
+					{
+						jag_flush_cancel(pixels);				// part filled, not for the panel
+						err = -1;
+					}
+					else	vncc_pixel_draw_lines(pixels, rec.width, n, rec.xpos, rec.ypos+l);	// converted in place and queued
 				}
 			break;
 
-			case VNC_ET_COPYRECT:
-				ESP_LOGE(TAG,"VNC_ET_COPYRECT not implimented yet");
+			case VNC_ET_COPYRECT:								// 0x0001
+				err = vncc_decode_copyrect(&rec);
+			break;
+
+			case VNC_ET_RRE:								// 0x0002
+				err = vncc_decode_rre(&rec, FALSE);
 			break;
-			case VNC_ET_RRE:
-				ESP_LOGE(TAG,"VNC_ET_RRE not implimented yet");
+
+			case VNC_ET_CORRE:								// 0x0004
+				err = vncc_decode_rre(&rec, TRUE);
 			break;
 				
-			case VNC_ET_HEXTILE:
-				ESP_LOGE(TAG,"VNC_ET_HEXTILE not implimented yet");
+			case VNC_ET_HEXTILE:								// 0x0005
+				err = vncc_decode_hextile(&rec);
 			break;
 
-			case VNC_ET_TRLE:
-				ESP_LOGE(TAG,"VNC_ET_TRLE not implimented yet");
-				
+			// Raw pixels inflated a flush buffer at a time, same as RAW
+			case VNC_ET_ZLIB:								// 0x0006
+				if (vncc_rx_read((char*)&zlen, 4)!=4 || vncc_inflate_init(&vncc_zlib)!=0)
+				{
+					vncc_shutdown();
+					err = -1;
+					break;
+				}
+				vncc_inflate_begin(&vncc_zlib, bswap32(zlen));
+				lpb = vncc_lines_per_buffer(rec.width);
+				for (l=0;l<rec.height && err==0;l=l+n)
+				{
+					n = rec.height-l;
+					if (n > lpb)
+						n = lpb;
+					pixels = jag_flush_get();
+					if (vncc_inflate_read(&vncc_zlib, pixels, n*rec.width*vncc_bpp) < 0)
+					{
+						jag_flush_cancel(pixels);
+						err = -1;
+					}
+					else	vncc_pixel_draw_lines(pixels, rec.width, n, rec.xpos, rec.ypos+l);
+				}
+				if (err==0)
+					err = vncc_inflate_end(&vncc_zlib);
+				if (err!=0)
+					vncc_shutdown();						// the stream carries on from here, it cannot be resynced
+			break;
+
+			case VNC_ET_TIGHT:								// 0x0007
+				err = vncc_decode_tight(&rec);
+			break;
+
+			case VNC_ET_CURSOR:								// -239
+				err = vncc_decode_cursor(&rec);
+			break;
+
+			case VNC_ET_POINTERPOS:								// -232
+				vncc_cursor_move(rec.xpos, rec.ypos);
+			break;
+
+			case VNC_ET_DESKTOPSIZE:							// -223
+				vncc_desktop_resized(rec.width, rec.height);
+			break;
+
+			case VNC_ET_EXTENDEDDESKTOPSIZE:						// -308
+				err = vncc_process_extendeddesktopsize(&rec);
+			break;
+
+			case VNC_ET_TRLE:								// 0x000F
+				err = vncc_decode_trle(&rec);
 			break;
 				
-			case VNC_ET_ZRLE:
-				ESP_LOGE(TAG,"VNC_ET_ZRLE not implimented yet");
+			case VNC_ET_ZRLE:								// 0x0010
+				err = vncc_decode_zrle(&rec);
 			break;
 
 			default:
@@ -392,9 +814,16 @@ void vncc_process_rectangle(int r)
         	eclock = (uint32_t)clock();
         	tms = (uint32_t) (eclock - sclock) * 1000 / CLOCKS_PER_SEC;
 		printf("took %ums\n", tms);
+		vncc_stats_rect(rec.encoding_type, rec.width*rec.height, vncc_rx_position()-spos,
+				(uint32_t)(esp_timer_get_time()-sus), (uint32_t)(vncc_stats.rx_wait_us-swait),
+				(uint32_t)(jag_get_stall_us()-slcd));
+		if (err!=0)
+		{
+			vncc_drain("process_rectangle decoder");
+			return;
+		}
 	}
 	else	ESP_LOGE(TAG,"vncc_process_rectangle() expected %d, got %d",sizeof(struct vnc_rect),len);
-	vncc_busy = FALSE;
 	return;
 }
 
@@ -404,52 +833,88 @@ static void vncc_process_framebufferupdate()
 	struct vnc_FramebufferUpdate		fbu;
 	int    r=0;
 	int    len=0;
-
-	len = readbytes(vncc_sock, (char*)&fbu, sizeof(struct vnc_FramebufferUpdate));
+	int64_t  sus = esp_timer_get_time();
+	uint32_t spos = vncc_rx_position();
+	uint64_t swait = vncc_stats.rx_wait_us;
+	uint64_t sstall = jag_get_stall_us();
+	uint64_t sbusy = jag_get_busy_us();
+	uint32_t us = 0;
+	uint32_t cpu = 0;
+
+	len = vncc_rx_read((char*)&fbu, sizeof(struct vnc_FramebufferUpdate));
 	if (len==sizeof(struct vnc_FramebufferUpdate))
 	{
 		fbu.num_of_rectangles	= bswap16(fbu.num_of_rectangles);
 		printf("Got VNC_SMT_FRAMEBUFFERUPDATE %d rectangles\n",fbu.num_of_rectangles);
 		if (fbu.num_of_rectangles==0)
+		{
+			vncc_request_answered(FALSE);
 			return;
+		}
 		if (fbu.num_of_rectangles >2048)						// unlikely, not a 4k display
 		{
 			vncc_drain("process_framebufferupdate()");
 			return;
 		}
 
+		vncc_in_update = TRUE;
+		vncc_request_answered(FALSE);							// next request goes while this one is drawn
+		jag_update_begin();								// with a shadow, changed tiles go as a batch
+		vncc_cursor_update_start();
 		for (r=0;r<fbu.num_of_rectangles;r++)						// N rectangles follow
+		{
 			vncc_process_rectangle(r);						// read and process each one
+			if (vncc_state==VNCC_NOT_CONNECTED)					// hung up part way through
+			{
+				vncc_in_update = FALSE;
+				jag_update_end();
+				return;
+			}
+		}
+		vncc_cursor_update_end();
+		jag_update_end();
+		vncc_in_update = FALSE;
+		us = (uint32_t)(esp_timer_get_time()-sus);
+		cpu = us - (uint32_t)(vncc_stats.rx_wait_us-swait) - (uint32_t)(jag_get_stall_us()-sstall);
+		vncc_stats_update(vncc_rx_position()-spos, us, cpu);
+		vncc_pace_drawn(cpu, (uint32_t)(jag_get_busy_us()-sbusy));
 	}
 	else	ESP_LOGE(TAG,"vncc_process_framebufferupdate() expected %d read, got %d",sizeof(struct vnc_FramebufferUpdate),len);
 }
 
 
 
-// Note: never been called hence untested
+// The palette for colour map mode, read a block of entries at a time into the receive buffer.
+// Pixels already on the panel keep their old colours so ask for the whole screen again
 static void vncc_process_colormapentry()
 {
-	int len=0;
 	struct vnc_colormapentry	cme;
-	struct vnc_rgbentry		rgbe;
-	int i=0;
+	int	len = 0;
+	int	n   = 0;
+	int	i   = 0;
 
-	len = readbytes(vncc_sock, (char*)&cme, sizeof(struct vnc_colormapentry));
-	if (len==sizeof(struct vnc_colormapentry))
+	len = vncc_rx_read((char*)&cme, sizeof(struct vnc_colormapentry));
+	if (len!=sizeof(struct vnc_colormapentry))
 	{
-		cme.first_color		= bswap16(cme.first_color);
-		cme.number_of_colors	= bswap16(cme.number_of_colors);
-		printf("Got VNC_SMT_SETCOLORMAPENTRIES  %d RGB entries follow\n",cme.number_of_colors);
+		ESP_LOGE(TAG,"vncc_process_colormapentry() expected %d read %d",sizeof(struct vnc_colormapentry), len);
+		return;
+	}
+	cme.first_color		= bswap16(cme.first_color);
+	cme.number_of_colors	= bswap16(cme.number_of_colors);
+	printf("Got VNC_SMT_SETCOLORMAPENTRIES %d RGB entries from %d\n",cme.number_of_colors,cme.first_color);
 
-		for (i=0;i<cme.number_of_colors;i++)
-		{
-			len=readbytes(vncc_sock, (char*)&rgbe, sizeof(struct vnc_rgbentry));
-			if (len!=sizeof(struct vnc_rgbentry))
-				return;								// Socket probably hung up
-			//printf("rgbe.red=%d\n",rgbe.red);
-		}
+	for (i=0;i<cme.number_of_colors;i=i+n)
+	{
+		n = cme.number_of_colors - i;
+		if (n > 256)
+			n = 256;
+		len = n*sizeof(struct vnc_rgbentry);
+		if (vncc_rx_read((char*)&vncc_rxbuf, len) != len)
+			return;									// Socket probably hung up
+		vncc_pixel_colourmap(cme.first_color+i, n, (uint8_t*)&vncc_rxbuf);
 	}
-	else	ESP_LOGE(TAG,"vncc_process_colormapentry() expected %d read %d",sizeof(struct vnc_colormapentry), len);
+	if (did_draw==TRUE)
+		vncc_send_framebuffer_update_request(0, 0, vncc_view_width(), vncc_view_height(), 0);
 }
 
 
@@ -459,12 +924,12 @@ static void vncc_process_servercuttext()
 	uint32_t i = 0;
 	char	 b;
 
-	readbytes(vncc_sock, (char*)&sct, sizeof(struct vnc_servercuttext));			// Get header
+	vncc_rx_read((char*)&sct, sizeof(struct vnc_servercuttext));			// Get header
 	sct.textlen = bswap32(sct.textlen);
 	printf("Got VNC_SMT_SERVERCUTTEXT %d bytes\n",sct.textlen);
 	for (i=0;i<sct.textlen;i++)
 	{
-		readbytes(vncc_sock, (char*)&b, 1);
+		vncc_rx_read((char*)&b, 1);
 		printf("%c",b);
 	}	
 	printf("\n");
@@ -472,6 +937,67 @@ static void vncc_process_servercuttext()
 
 
 
+// Sent once to say the server does ContinuousUpdates, and again if it stops pushing
+static void vncc_process_endofcontinuousupdates()
+{
+	if (vncc_cu_enabled==TRUE)
+	{
+		ESP_LOGI(TAG,"Server stopped continuous updates, polling again");
+		vncc_cu_enabled = FALSE;
+		vncc_stats.cu_enabled = FALSE;
+		vncc_request_answered(TRUE);
+		return;
+	}
+	if (vncc_cu_supported==TRUE)
+		return;
+	vncc_cu_supported = TRUE;
+	vncc_try_continuous_updates();
+}
+
+
+
+// Answer a ServerFence.  Messages are decoded and drawn in order on this task, so by the time
+// we read a fence everything before it is on the panel, BlockBefore, BlockAfter and SyncNext
+// all hold without doing anything more.  The server times our answers to decide how much to send
+static void vncc_process_serverfence()
+{
+	struct vnc_ServerFence		sf;
+	struct vnc_ClientFence		cf;
+	int	len = 0;
+
+	if (vncc_rx_read((char*)&sf, sizeof(struct vnc_ServerFence)) != sizeof(struct vnc_ServerFence))
+		return;
+	sf.flags = bswap32(sf.flags);
+	if (sf.length > VNC_FENCE_MAXPAYLOAD)
+	{
+		ESP_LOGE(TAG,"vncc_process_serverfence() payload of %d bytes", sf.length);
+		vncc_drain("serverfence");
+		return;
+	}
+	if (sf.length>0 && vncc_rx_read((char*)&cf.payload, sf.length) != sf.length)
+		return;
+	vncc_fence_supported = TRUE;
+	if ((sf.flags & VNC_FENCE_REQUEST) != 0)
+	{
+		jag_flush_wait();								// what came before the fence is on the panel
+		memset(&cf.padding, 0, sizeof(cf.padding));
+		cf.msg_type	= VNC_CMT_CLIENTFENCE;
+		cf.flags	= bswap32(sf.flags & (VNC_FENCE_BLOCKBEFORE | VNC_FENCE_BLOCKAFTER | VNC_FENCE_SYNCNEXT));
+		cf.length	= sf.length;
+		len = sizeof(struct vnc_ClientFence) - VNC_FENCE_MAXPAYLOAD + sf.length;
+		if (vncc_tx_send((char*)&cf, len) != len)
+		{
+			ESP_LOGE(TAG,"vncc_process_serverfence() - failed to send %d bytes", len);
+			vncc_shutdown();
+			return;
+		}
+		vncc_stats.fences++;
+	}
+	vncc_try_continuous_updates();
+}
+
+
+
 // The VNC server and the client do not agree on display dimensions
 void display_mismatch()
 {
@@ -508,15 +1034,15 @@ void display_mismatch()
 	}
 	lcd_textbuf_printstring("\n");
 
-	if (vncc_si.pf_depth != 16)
+	if (vncc_si.pf_bpp != 32 && vncc_si.pf_bpp != 16 && vncc_si.pf_bpp != 8 && vncc_pixel_fmt == VNCC_PF_SERVER)
 	{
-		sprintf(st,"Got bpp=%d need 16", vncc_si.pf_depth);
+		sprintf(st,"Got bpp=%d need 8, 16 or 32", vncc_si.pf_bpp);			// otherwise the server is asked for RGB565
 		lcd_textbuf_printstring(st);
 		ESP_LOGE(TAG,"%s",st);
 	}
 	else
 	{
-		sprintf(st,"Got bpp=%d  OK", vncc_si.pf_depth);
+		sprintf(st,"Got bpp=%d depth=%d  OK", vncc_si.pf_bpp, vncc_si.pf_depth);
 		lcd_textbuf_printstring(st);
 		ESP_LOGI(TAG,"%s",st);
 	}
@@ -526,8 +1052,9 @@ void display_mismatch()
 
 
 
+// One step of the protocol, connect, a handshake state or one message from the server
 // TODO:  Extract server major and minor verison, check we have a new enough version
-static void vncc_client_task(void *pvParameters)
+static void vncc_step()
 {
 	int len=0;
 	int err=0;
@@ -539,178 +1066,250 @@ static void vncc_client_task(void *pvParameters)
 	int	 gotone=FALSE;
 
 	bzero(&st,sizeof(st));
-	while (1)
+	if (vncc_state!=VNCC_MAINLOOP)
+		printf("vncc_state=%d\n",vncc_state);
+	switch (vncc_state)
 	{
-		if (vncc_state!=VNCC_MAINLOOP)
-			printf("vncc_state=%d\n",vncc_state);
-		switch (vncc_state)
-		{
-			case VNCC_NOT_CONNECTED:
-				vncc_busy = FALSE;
-				if (vncc_sock<=0)						// No TCP connection yet ?
+		case VNCC_NOT_CONNECTED:
+			if (vncc_sock<=0)						// No TCP connection yet ?
+			{
+				do							// then keep trying
 				{
-					do							// then keep trying
+					vncc_doconnect();				// to connect
+					if (vncc_sock<=0)
 					{
-						vncc_doconnect();				// to connect
-						if (vncc_sock<=0)
-						{
-							lcd_textbuf_printstring("Failed to connect\n");
-							vTaskDelay(3000 / portTICK_PERIOD_MS);
-						}
-						else	
-						{
-							lcd_textbuf_printstring("Got connection\n");
-							ESP_LOGI(TAG,"Got connection");
-							vncc_state = VNCC_EXPECTING_GREETING;
-						}
-					} while (vncc_sock<=0);
-				}
-			break;
-
-
-
-			case VNCC_EXPECTING_GREETING:
-				bzero(&vncc_rxbuf,sizeof(vncc_rxbuf));
-				len = readbytes(vncc_sock, (char*)&vncc_rxbuf, 12);		// greeting always 12 bytes
-				if (len!=12)
-				{
-					ESP_LOGE(TAG,"expected 12 bytes, got %d",len);
-					vncc_shutdown();
-				}
-				if (strncmp((char*)&vncc_rxbuf,"RFB",3)==0)			// Greeting magic good ?
-				{
-					ESP_LOGI(TAG, "Successfully connected %s",vncc_rxbuf);
-					sprintf(vncc_txbuf,"RFB 003.008\n");
-					err = send(vncc_sock, (char*)&vncc_txbuf, 12, 0);	// Send my version
-					if (err<0)	
+						lcd_textbuf_printstring("Failed to connect\n");
+						vTaskDelay(3000 / portTICK_PERIOD_MS);
+					}
+					else	
 					{
-						sprintf(st,"Server hungup when sending version");
-						ESP_LOGE(TAG,"%s",st);
-						lcd_textbuf_printstring(st);
-						lcd_textbuf_printstring("\n");
-						vncc_shutdown();
+						lcd_textbuf_printstring("Got connection\n");
+						ESP_LOGI(TAG,"Got connection");
+						vncc_state = VNCC_EXPECTING_GREETING;
 					}
-					vncc_state = VNCC_EXPECTING_NUM_SECURITY_TYPES;
-				}
-				else	
-				{
-					sprintf(st,"VNC greet has bad magic");
-					ESP_LOGE(TAG,"%s",st);
-					lcd_textbuf_printstring(st);
-					lcd_textbuf_printstring("\n");
-					vncc_shutdown();
-				}
-			break;
+				} while (vncc_sock<=0);
+			}
+		break;
 
 
-			//TODO: Some actual authentication
-			case VNCC_EXPECTING_NUM_SECURITY_TYPES:
-				len = readbytes(vncc_sock, (char*)&x, 1);			// read 1 unsigned 8 bit
-				ns=x;								// number of security types to follow
-				printf("Server sending list of %d security types\n",x);
-				gotone=FALSE;
-				for (i=0;i<ns;i++)
-				{
-					len = readbytes(vncc_sock, (char*)&x, 1);		// read values one at a time
-					printf("\tSever supports security type %d\n",x);
-					if (x==1)
-						gotone=TRUE;
-				}
-				if (gotone != TRUE)
+
+		case VNCC_EXPECTING_GREETING:
+			bzero(&vncc_rxbuf,sizeof(vncc_rxbuf));
+			len = vncc_rx_read((char*)&vncc_rxbuf, 12);		// greeting always 12 bytes
+			if (len!=12)
+			{
+				ESP_LOGE(TAG,"expected 12 bytes, got %d",len);
+				vncc_shutdown();
+			}
+			if (strncmp((char*)&vncc_rxbuf,"RFB",3)==0)			// Greeting magic good ?
+			{
+				ESP_LOGI(TAG, "Successfully connected %s",vncc_rxbuf);
+				sprintf(vncc_txbuf,"RFB 003.008\n");
+				err = vncc_tx_send((char*)&vncc_txbuf, 12);	// Send my version
+				if (err<0)	
 				{
-					sprintf(st,"VNC did not list SecurityType = 1 (NONE), This code needs a VNC server with no authentication");
+					sprintf(st,"Server hungup when sending version");
 					ESP_LOGE(TAG,"%s",st);
 					lcd_textbuf_printstring(st);
 					lcd_textbuf_printstring("\n");
 					vncc_shutdown();
-					vTaskDelay(10000 / portTICK_PERIOD_MS);
 				}
-				vncc_txbuf[0]=1;						// Send my security type (1=NONE)
-				err = send(vncc_sock, (char*)&vncc_txbuf, 1, 0);		
-				vncc_state = VNCC_EXPECTING_SECURITY_RESULT;
-			break;
+				vncc_state = VNCC_EXPECTING_NUM_SECURITY_TYPES;
+			}
+			else	
+			{
+				sprintf(st,"VNC greet has bad magic");
+				ESP_LOGE(TAG,"%s",st);
+				lcd_textbuf_printstring(st);
+				lcd_textbuf_printstring("\n");
+				vncc_shutdown();
+			}
+		break;
 
 
+		//TODO: Some actual authentication
+		case VNCC_EXPECTING_NUM_SECURITY_TYPES:
+			len = vncc_rx_read((char*)&x, 1);			// read 1 unsigned 8 bit
+			ns=x;								// number of security types to follow
+			printf("Server sending list of %d security types\n",x);
+			gotone=FALSE;
+			for (i=0;i<ns;i++)
+			{
+				len = vncc_rx_read((char*)&x, 1);		// read values one at a time
+				printf("\tSever supports security type %d\n",x);
+				if (x==1)
+					gotone=TRUE;
+			}
+			if (gotone != TRUE)
+			{
+				sprintf(st,"VNC did not list SecurityType = 1 (NONE), This code needs a VNC server with no authentication");
+				ESP_LOGE(TAG,"%s",st);
+				lcd_textbuf_printstring(st);
+				lcd_textbuf_printstring("\n");
+				vncc_shutdown();
+				vTaskDelay(10000 / portTICK_PERIOD_MS);
+			}
+			vncc_txbuf[0]=1;						// Send my security type (1=NONE)
+			err = vncc_tx_send((char*)&vncc_txbuf, 1);		
+			vncc_state = VNCC_EXPECTING_SECURITY_RESULT;
+		break;
 
-			case VNCC_EXPECTING_SECURITY_RESULT:
-				len = readbytes(vncc_sock, (char*)&vncc_rxbuf, 4);		// Expecting "SecurityResult" (4) 
-				if (len==4)
-				{
-					printf("security result (should be 00 00 00 00) = ");
-					dumphex((char*)&vncc_rxbuf, 4);
-					vncc_txbuf[0]=1;					// Send ClientInit (Shared)
-					err = send(vncc_sock, (char*)&vncc_txbuf, 1, 0);		
-					vncc_state = VNCC_EXPECTING_SERVER_INIT;
-				}
-				else	vncc_shutdown();
-			break;
 
 
-			case VNCC_EXPECTING_SERVER_INIT:
-				vTaskDelay(1000 / portTICK_PERIOD_MS);
-				len = readbytes(vncc_sock, (char*)&vncc_rxbuf, sizeof(struct vnc_ServerInit));
-				printf("read server init, got %d bytes, expecting %d\n",len,sizeof(struct vnc_ServerInit));
-				dumphex((char*)&vncc_rxbuf, len);
-				if (len==sizeof(struct vnc_ServerInit))
-					process_server_init((struct vnc_ServerInit*)&vncc_rxbuf);
-				else	vncc_shutdown();
+		case VNCC_EXPECTING_SECURITY_RESULT:
+			len = vncc_rx_read((char*)&vncc_rxbuf, 4);		// Expecting "SecurityResult" (4) 
+			if (len==4)
+			{
+				printf("security result (should be 00 00 00 00) = ");
+				dumphex((char*)&vncc_rxbuf, 4);
+				vncc_txbuf[0]=1;					// Send ClientInit (Shared)
+				err = vncc_tx_send((char*)&vncc_txbuf, 1);		
+				vncc_state = VNCC_EXPECTING_SERVER_INIT;
+			}
+			else	vncc_shutdown();
+		break;
 
-				if (vncc_si.fbwidth != jag_get_display_width() || vncc_si.fbheight != jag_get_display_height() || vncc_si.pf_depth != 16)
-				{
-					display_mismatch();
-					vncc_shutdown();
-					vTaskDelay(8000 / portTICK_PERIOD_MS);
-				}
-				else
-				{
-					vncc_send_setencodings(); 
-					lcd_textbuf_enable(FALSE, FALSE);				// Make sure task stops driving SPI LCD
-					//vncc_send_framebuffer_update_request(0, 0, 240, 320, 0);	// ASk for entire screen now
-					vncc_send_framebuffer_update_request(0, 0, jag_get_display_width(), 
-									     jag_get_display_height(), 0);	// ASk for entire screen now
-					vncc_state = VNCC_MAINLOOP;
-				}
-			break;
 
+		case VNCC_EXPECTING_SERVER_INIT:
+			len = vncc_rx_read((char*)&vncc_rxbuf, sizeof(struct vnc_ServerInit));
+			printf("read server init, got %d bytes, expecting %d\n",len,sizeof(struct vnc_ServerInit));
+			dumphex((char*)&vncc_rxbuf, len);
+			if (len==sizeof(struct vnc_ServerInit))
+				process_server_init((struct vnc_ServerInit*)&vncc_rxbuf);
+			else	vncc_shutdown();
 
-			case VNCC_MAINLOOP:
-				len=readbytes(vncc_sock, (char*)&msg_type,1);
-				//printf("msg_type=%02X (%d)\n",msg_type,msg_type); fflush(stdout);
-				switch (msg_type)
-				{
-					case VNC_SMT_FRAMEBUFFERUPDATE:				// 0
-						vncc_process_framebufferupdate();
-					break;
+			if (vncc_si.pf_bpp != 32 && vncc_si.pf_bpp != 16 && vncc_si.pf_bpp != 8 && vncc_pixel_fmt == VNCC_PF_SERVER)
+			{
+				display_mismatch();
+				vncc_shutdown();
+				vTaskDelay(8000 / portTICK_PERIOD_MS);
+			}
+			else
+			{
+				if (vncc_si.fbwidth != jag_get_display_width() || vncc_si.fbheight != jag_get_display_height())
+					display_mismatch();					// server is asked to resize once it says it can
+				vncc_choose_pixelformat();
+				vncc_send_setencodings(); 
+				lcd_textbuf_enable(FALSE, FALSE);				// Make sure task stops driving SPI LCD
+				if (vncc_si.fbwidth < jag_get_display_width() || vncc_si.fbheight < jag_get_display_height())
+					jag_cls(0);
+				vncc_send_framebuffer_update_request(0, 0, vncc_view_width(), 
+								     vncc_view_height(), 0);	// ASk for entire screen now
+				vncc_state = VNCC_MAINLOOP;
+			}
+		break;
 
-					case VNC_SMT_SETCOLORMAPENTRIES:			// 1
-						vncc_process_colormapentry();
-					break;
-	
-					case VNC_SMT_BELL:					// 2
-						ESP_LOGE(TAG,"VNC_SMT_BELL Not implimented yet");
-					break;
-	
-					case VNC_SMT_SERVERCUTTEXT:				// 3
-						vncc_process_servercuttext();
-					break;
 
-					default:
-						ESP_LOGE(TAG,"got msg_type %02X ?",msg_type);
-						vncc_drain("mainloop");
-					break;
-				}
-			break;
-		}
-		vTaskDelay(5 / portTICK_PERIOD_MS);
+		case VNCC_MAINLOOP:
+			len=vncc_rx_read((char*)&msg_type,1);
+			//printf("msg_type=%02X (%d)\n",msg_type,msg_type); fflush(stdout);
+			switch (msg_type)
+			{
+				case VNC_SMT_FRAMEBUFFERUPDATE:				// 0
+					vncc_process_framebufferupdate();
+				break;
+
+				case VNC_SMT_SETCOLORMAPENTRIES:			// 1
+					vncc_process_colormapentry();
+				break;
+
+				case VNC_SMT_BELL:					// 2
+					ESP_LOGE(TAG,"VNC_SMT_BELL Not implimented yet");
+				break;
+
+				case VNC_SMT_SERVERCUTTEXT:				// 3
+					vncc_process_servercuttext();
+				break;
+
+				case VNC_SMT_ENDOFCONTINUOUSUPDATES:			// 150
+					vncc_process_endofcontinuousupdates();
+				break;
+
+				case VNC_SMT_SERVERFENCE:				// 248
+					vncc_process_serverfence();
+				break;
+
+				default:
+					ESP_LOGE(TAG,"got msg_type %02X ?",msg_type);
+					vncc_drain("mainloop");
+				break;
+			}
+		break;
 	}
 }
 
 
 
-// socket reads are blocking, so best to do the requests on a task of its own
-static void vncc_periodic_request_and_touch_task(void *pvParameters)
+#ifdef VNCC_REPLAY
+// A recorded server stream (main/replay.rfb, embedded by CMakeLists.txt) is decoded at boot before
+// connecting, read by vncc_rx.c VNCC_REPLAY_CHUNK bytes at a time as the decoders ask for more.
+// Any size gives the same picture, it shows how the receive buffer copes with split messages
+#define VNCC_REPLAY_CHUNK		1460							// one TCP segment
+extern const uint8_t	replay_rfb_start[]	asm("_binary_replay_rfb_start");
+extern const uint8_t	replay_rfb_end[]	asm("_binary_replay_rfb_end");
+static const uint8_t	*replay_pos	= NULL;
+static const uint8_t	*replay_end	= NULL;
+
+static int vncc_replay_source(uint8_t *buf, int max)
+{
+	int	n = replay_end - replay_pos;
+
+	if (n > max)
+		n = max;
+	if (n > VNCC_REPLAY_CHUNK)
+		n = VNCC_REPLAY_CHUNK;
+	memcpy(buf, replay_pos, n);
+	replay_pos = replay_pos + n;
+	return(n);
+}
+
+
+
+// Decode a recorded session from greeting to the end of the recording as fast as the panel
+// allows, the same code as a live connection with the network taken out
+static void vncc_replay(const uint8_t *rec, int len)
+{
+	int64_t		st = 0;
+	int64_t		us = 0;
+
+	ESP_LOGI(TAG,"replay: %d bytes in chunks of %d", len, VNCC_REPLAY_CHUNK);
+	replay_pos = rec;
+	replay_end = rec + len;
+	vncc_session_reset();
+	vncc_rx_replay(vncc_replay_source);
+	vncc_state = VNCC_EXPECTING_GREETING;
+	st = esp_timer_get_time();
+	while (vncc_state!=VNCC_NOT_CONNECTED)
+		vncc_step();
+	jag_flush_wait();
+	us = esp_timer_get_time() - st;
+	ESP_LOGI(TAG,"replay: %d of %d bytes parsed in %lldms, %lld KB/s", (int)(replay_pos-rec), len,
+		us/1000, (us>0) ? ((int64_t)len*1000000/1024)/us : 0);
+	vncc_stats_print();
+	lcd_textbuf_enable(TRUE, did_draw);							// text mode for the live connection
+	did_draw = FALSE;
+}
+#endif
+
+
+
+static void vncc_client_task(void *pvParameters)
+{
+#ifdef VNCC_REPLAY
+	vncc_replay(replay_rfb_start, replay_rfb_end - replay_rfb_start);
+#endif
+	while (1)
+		vncc_step();
+}
+
+
+
+// Read the touch panel, called by the flush task with the LCD semaphore held as the touch controller
+// shares the LCD's SPI bus.  Presses go to vnc_task through vncc_touches, dropped if it has not taken the ones before
+static void vncc_touch_sample()
 {
 	touch_panel_points_t    points;
+	struct vncc_touch	t;
 	uint32_t 		x=0;
 	uint32_t		y=0;
 	uint32_t		e=0;
@@ -718,49 +1317,90 @@ static void vncc_periodic_request_and_touch_task(void *pvParameters)
 	static int		py=0;
 	static int		pe=0;
 
-	while (1)
+	touch_drv.read_point_data(&points);
+	x=points.curx[0];
+	y=points.cury[0];
+	e=points.event;
+	if (x!=px || y!=py || e!=pe)								// cursor changed ?
 	{
-		if (vncc_state==VNCC_MAINLOOP && vncc_sock >0)
+		if (e == TOUCH_EVT_PRESS)
 		{
-			if (vncc_busy!=TRUE)							// Connected and otherwise idle
-				//vncc_send_framebuffer_update_request(0, 0, 240, 320, 1);	// Ask for rectangles (incremental)
-				vncc_send_framebuffer_update_request(0, 0, jag_get_display_width(),
-								     jag_get_display_height(), 1);	// Ask for rectangles (incremental)
-
-			touch_drv.read_point_data(&points);
-			x=points.curx[0];
-			y=points.cury[0];
-			e=points.event;
-			if (x!=px || y!=py || e!=pe)						// cursor changed ?
-			{
-				if (e == TOUCH_EVT_PRESS)
-				{
-					vncc_send_pointer_event((uint16_t)x, (uint16_t)y, 1);	// mouse push down
-					vncc_send_pointer_event((uint16_t)x, (uint16_t)y, 0);	// mouse release
-				}
-				px=x;
-				py=y;
-				pe=e;
-			}
+			t.x = x;
+			t.y = y;
+			spsc_put(&vncc_touches, &t, 0);
 		}
-		vTaskDelay((1000/vncc_update_rate_hz) / portTICK_PERIOD_MS);			// limit request rate to N Hz
+		px=x;
+		py=y;
+		pe=e;
 	}
 }
 
 
 
-void vncc_connect(char *host_ip, int screennum)
+// Everything except reading from the server: update requests, touches and the counters.
+// vncc_rx.c calls this whenever vnc_task would wait for the socket, returns how long it may sleep in ms
+int vncc_service()
 {
-	if (vncc_sock >0)									// already connected ?
-		vncc_shutdown();								// then hang up now
+	struct vncc_touch	t;
+	int64_t			now=esp_timer_get_time();
+	int64_t			next=0;
+
+	if (vncc_reconnect==TRUE)								// vncc_connect() from another task
+	{
+		vncc_reconnect = FALSE;
+		vncc_shutdown();
+	}
+	if (vncc_state!=VNCC_MAINLOOP || vncc_sock <0)
+		return(VNCC_RX_POLL_MS);
+
+	if (vncc_cu_enabled!=TRUE && vncc_inflight<VNCC_REQUESTS_INFLIGHT &&		// Connected, not pushed to and room for a request
+	    now >= vncc_pace_next())							// and not before the pacing allows
+		//vncc_send_framebuffer_update_request(0, 0, 240, 320, 1);		// Ask for rectangles (incremental)
+		vncc_send_framebuffer_update_request(0, 0, vncc_view_width(),
+						     vncc_view_height(), 1);		// Ask for rectangles (incremental)
+
+	if (now >= vncc_touch_next)
+	{
+		vncc_touch_next = now + (1000000/vncc_update_rate_hz);
+		while (spsc_get(&vncc_touches, &t, 0)==TRUE)
+		{
+			vncc_send_pointer_event(t.x, t.y, 1);					// mouse push down
+			vncc_send_pointer_event(t.x, t.y, 0);					// mouse release
+		}
+	}
 
+	if (now-vncc_lastprint > VNCC_STATS_INTERVAL_S*1000000LL)
+	{
+		vncc_stats_print();
+		vncc_lastprint = now;
+	}
+
+	next = vncc_touch_next;									// sleep until it is time to look for touches
+	if (vncc_cu_enabled!=TRUE && vncc_inflight<VNCC_REQUESTS_INFLIGHT && vncc_pace_next() < next)
+		next = vncc_pace_next();							// or the next request
+	next = (next - esp_timer_get_time() + 999) / 1000;
+	if (next < 1)
+		next = 1;
+	if (next > VNCC_RX_POLL_MS)
+		next = VNCC_RX_POLL_MS;
+	return((int)next);
+}
+
+
+
+void vncc_connect(char *host_ip, int screennum)
+{
 	strncpy(vncc_host_ip, host_ip, sizeof(vncc_host_ip));
 	vncc_screennum=screennum;
+	if (vncc_taskcreated==TRUE)								// already running ?
+		vncc_reconnect = TRUE;								// then vnc_task hangs up and tries the new one
 	if (vncc_taskcreated!=TRUE)
 	{
 		vncc_taskcreated=TRUE;
-		xTaskCreate(vncc_client_task, "vnc_task", 20*1024, NULL, configMAX_PRIORITIES -1 , NULL);
-		xTaskCreate(vncc_periodic_request_and_touch_task, "req_task", 8*1024, NULL, 5, NULL);
+		spsc_init(&vncc_touches, 8, sizeof(struct vncc_touch));
+		jag_flush_poll(vncc_touch_sample, 1000/vncc_update_rate_hz);
+		vncc_stats_load_init();
+		xTaskCreatePinnedToCore(vncc_client_task, "vnc_task", 20*1024, NULL, VNCC_PRIORITY, NULL, VNCC_CORE);
 	}
 }
 
@@ -13,6 +13,17 @@
  * GNU General Public License for more details.
  */
 
+#define TRUE					1
+#define FALSE					0
+
+// vnc_task receives and decodes on one core while the flush task (JAG_FLUSH_CORE) drives the SPI bus
+// on the other, the one the Wi-Fi task is pinned to.  lwIP's tcpip task is not pinned
+// (CONFIG_LWIP_TCPIP_TASK_AFFINITY_NO_AFFINITY) and may run on either, so both run one priority
+// below it and neither can hold off the network vnc_task reads from
+#define VNCC_CORE				(portNUM_PROCESSORS-1)
+#define VNCC_PRIORITY				(ESP_TASK_TCPIP_PRIO-1)
+
+
 //  State machine
 
 #define VNCC_NOT_CONNECTED			0
@@ -34,21 +45,39 @@
 #define VNC_CMT_KEYEVENT			4
 #define VNC_CPOINTEREVENT			5
 #define VNC_CLIENTCUTTEXT			6
+#define VNC_CMT_ENABLECONTINUOUSUPDATES		150
+#define VNC_CMT_CLIENTFENCE			248
+#define VNC_CMT_SETDESKTOPSIZE			251
 
 // Server message type 
 #define VNC_SMT_FRAMEBUFFERUPDATE		0
 #define VNC_SMT_SETCOLORMAPENTRIES		1
 #define VNC_SMT_BELL				2
 #define VNC_SMT_SERVERCUTTEXT			3
+#define VNC_SMT_ENDOFCONTINUOUSUPDATES		150
+#define VNC_SMT_SERVERFENCE			248
 
 // Encoding types
 #define VNC_ET_RAW				0
 #define VNC_ET_COPYRECT				1
 #define VNC_ET_RRE				2
+#define VNC_ET_CORRE				4
 #define VNC_ET_HEXTILE				5
+#define VNC_ET_ZLIB				6
+#define VNC_ET_TIGHT				7
 #define VNC_ET_TRLE				15
 #define VNC_ET_ZRLE				16
 
+// Pseudo encodings
+#define VNC_ET_COMPRESSLEVEL0			-256					// Tight/ZRLE zlib level 0-9, -256 to -247
+#define VNC_ET_QUALITYLEVEL0			-32					// Tight JPEG quality 0-9, -32 to -23
+#define VNC_ET_CURSOR				-239
+#define VNC_ET_POINTERPOS			-232
+#define VNC_ET_DESKTOPSIZE			-223
+#define VNC_ET_EXTENDEDDESKTOPSIZE		-308
+#define VNC_ET_FENCE				-312
+#define VNC_ET_CONTINUOUSUPDATES		-313
+
 
 
 struct __attribute__ ((__packed__)) vnc_servercuttext
@@ -129,13 +158,38 @@ struct __attribute__ ((__packed__)) vnc_rgbentry
 };
 
 
+// Same layout as the pixel format in vnc_ServerInit
+struct __attribute__ ((__packed__)) vnc_PixelFormat
+{
+	uint8_t		bpp;
+	uint8_t		depth;
+	uint8_t		bigendian;
+	uint8_t		truecolor;
+	uint16_t	maxred;
+	uint16_t	maxgreen;
+	uint16_t	maxblue;
+	uint8_t		shiftred;
+	uint8_t		shiftgreen;
+	uint8_t		shiftblue;
+	uint8_t		padding[3];
+};
+
+
 struct __attribute__ ((__packed__)) vnc_SetPixelFormat
 {
+	uint8_t		msg_type;
 	uint8_t		padding[3];
-	uint16_t	pixel_format;
+	struct vnc_PixelFormat	pf;
 };
 
 
+// Pixel formats the client can ask for, vncc_pixel_format in lcd_vncc.c
+#define VNCC_PF_SERVER				0					// whatever ServerInit said
+#define VNCC_PF_BGR233				1					// 8 bit true colour, for slow links
+#define VNCC_PF_COLOURMAP			2					// 8 bit palette set by the server
+#define VNCC_PF_RGB565				3					// big endian, the panels byte order
+
+
 // A number of int32_t follow SetEncodings, taken from encoding type VNC_ET_XXX
 struct __attribute__ ((__packed__)) vnc_SetEncodings
 {
@@ -145,6 +199,78 @@ struct __attribute__ ((__packed__)) vnc_SetEncodings
 };
 
 
+// ExtendedDesktopSize rectangle, x is the reason, y the status, width and height the new size.
+// Number of screens then padding then that many screens follow
+#define VNC_EDS_REASON_CLIENT			1					// answer to our SetDesktopSize
+struct __attribute__ ((__packed__)) vnc_ExtendedDesktopSize
+{
+	uint8_t		number_of_screens;
+	uint8_t		padding[3];
+};
+
+
+struct __attribute__ ((__packed__)) vnc_screen
+{
+	uint32_t	id;
+	uint16_t	xpos;
+	uint16_t	ypos;
+	uint16_t	width;
+	uint16_t	height;
+	uint32_t	flags;
+};
+
+
+// One vnc_screen follows
+struct __attribute__ ((__packed__)) vnc_SetDesktopSize
+{
+	uint8_t		msg_type;
+	uint8_t		padding;
+	uint16_t	width;
+	uint16_t	height;
+	uint8_t		number_of_screens;
+	uint8_t		padding2;
+	struct vnc_screen screen;
+};
+
+
+// Server pushes updates for the area without FramebufferUpdateRequests, enable=0 stops it
+struct __attribute__ ((__packed__)) vnc_EnableContinuousUpdates
+{
+	uint8_t		msg_type;
+	uint8_t		enable;
+	uint16_t	xpos;
+	uint16_t	ypos;
+	uint16_t	width;
+	uint16_t	height;
+};
+
+
+// Fence flags
+#define VNC_FENCE_BLOCKBEFORE			0x00000001				// earlier messages done before the fence
+#define VNC_FENCE_BLOCKAFTER			0x00000002				// later messages wait for the fence
+#define VNC_FENCE_SYNCNEXT			0x00000004				// reply after the next message is done
+#define VNC_FENCE_REQUEST			0x80000000				// other end must answer
+#define VNC_FENCE_MAXPAYLOAD			64
+
+// ServerFence after the msg_type byte, length bytes of payload follow
+struct __attribute__ ((__packed__)) vnc_ServerFence
+{
+	uint8_t		padding[3];
+	uint32_t	flags;
+	uint8_t		length;
+};
+
+
+struct __attribute__ ((__packed__)) vnc_ClientFence
+{
+	uint8_t		msg_type;
+	uint8_t		padding[3];
+	uint32_t	flags;
+	uint8_t		length;
+	uint8_t		payload[VNC_FENCE_MAXPAYLOAD];
+};
+
+
 // Send a single encoding type
 struct __attribute__ ((__packed__)) vnc_send_encoding_type
 {
@@ -156,6 +282,7 @@ struct __attribute__ ((__packed__)) vnc_send_encoding_type
 // Prototypes
 void vncc_connect(char* hostname, int screennum);
 void vncc_shutdown();
+int  vncc_service();
 void vncc_send_pointer_event(uint16_t x, uint16_t y, uint8_t msk);
 
 
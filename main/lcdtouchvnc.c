@@ -51,6 +51,7 @@
 
 
 scr_driver_t				lcd_drv; 
+scr_interface_driver_t			*lcd_iface = NULL;
 touch_panel_driver_t 			touch_drv;
 const char 				*TAG = "lcdtouchvnc";
 char					client_ip[16];
@@ -76,7 +77,9 @@ void app_main(void)
 	//                      landscape:  SCR_DIR_TBLR,  SCR_DIR_BTLR,  SCR_DIR_TBRL,  SCR_DIR_BTRL
 	//lcd_ts_rotate(SCR_DIR_TBLR);								// comment out for default potrait LRBT
 
-	jag_init((scr_driver_t*)&lcd_drv);							// initialise my graphics library
+	jag_init((scr_driver_t*)&lcd_drv, lcd_iface, LCD_READBACK, LCD_SWAP_DATA);				// initialise my graphics library
+	if (LCD_SHADOW==1)
+		jag_shadow_init();								// draw into RAM, send what changed
 	lcd_textbuf_init(&Font12, -1, -1, -1, -1);						// initialise the text terminal
 	lcd_textbuf_setcolors(COLOR_WHITE, COLOR_BLUE);
 	lcd_textbuf_enable(TRUE, TRUE);								// text terminal active and clear display
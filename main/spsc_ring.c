@@ -0,0 +1,110 @@
+/*
+ * spsc_ring.c
+ * Lock free ring of fixed size items for one producer task and one consumer task
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+/*
+	The two tasks may be on different cores.  head and tail count items put and taken and only
+	ever go up, the slot is the count modulo n.  An item is copied in before head is moved past
+	it and copied out before tail is, with release/acquire ordering, so neither side takes a lock
+	or disables interrupts.
+
+	A side that finds the ring full (or empty) sets its task handle, looks again, then sleeps on
+	its task notification.  The other side notifies it after moving its count.  Both put a full
+	barrier between their store and their load, so one of them always sees the other and a wake
+	up cannot be lost.  A notification that arrives for another reason just means another look.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "screen_driver.h"
+#include "jag.h"
+#include "spsc_ring.h"
+
+
+
+// n slots (a power of 2) of size bytes, returns FALSE if there is no memory
+int spsc_init(struct spsc_ring *r, uint32_t n, uint32_t size)
+{
+	bzero(r, sizeof(struct spsc_ring));
+	if (n==0 || (n & (n-1))!=0)
+		return(FALSE);
+	r->items = malloc(n*size);
+	if (r->items==NULL)
+		return(FALSE);
+	r->n	= n;
+	r->size	= size;
+	return(TRUE);
+}
+
+
+
+// Copy item in, waiting up to wait ticks for room.  Producer only, returns FALSE if still full
+int spsc_put(struct spsc_ring *r, const void *item, TickType_t wait)
+{
+	uint32_t	h = r->head;
+	TaskHandle_t	c = NULL;
+
+	while (h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= r->n)			// full
+	{
+		if (wait==0)
+			return(FALSE);
+		r->producer = xTaskGetCurrentTaskHandle();
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= r->n &&
+		    ulTaskNotifyTake(pdTRUE, wait) == 0)
+			wait = 0;								// timed out, one last look
+		r->producer = NULL;
+	}
+	memcpy(&r->items[(h & (r->n-1)) * r->size], item, r->size);
+	__atomic_store_n(&r->head, h+1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if ((c = r->consumer) != NULL)
+		xTaskNotifyGive(c);
+	return(TRUE);
+}
+
+
+
+// Copy the oldest item out, waiting up to wait ticks for one.  Consumer only, returns FALSE if still empty
+int spsc_get(struct spsc_ring *r, void *item, TickType_t wait)
+{
+	uint32_t	t = r->tail;
+	TaskHandle_t	p = NULL;
+
+	while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == t)				// empty
+	{
+		if (wait==0)
+			return(FALSE);
+		r->consumer = xTaskGetCurrentTaskHandle();
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == t &&
+		    ulTaskNotifyTake(pdTRUE, wait) == 0)
+			wait = 0;								// timed out, one last look
+		r->consumer = NULL;
+	}
+	memcpy(item, &r->items[(t & (r->n-1)) * r->size], r->size);
+	__atomic_store_n(&r->tail, t+1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if ((p = r->producer) != NULL)
+		xTaskNotifyGive(p);
+	return(TRUE);
+}
@@ -0,0 +1,34 @@
+/*
+ * spsc_ring.h
+ * Lock free ring of fixed size items for one producer task and one consumer task
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+struct spsc_ring
+{
+	uint8_t			*items;
+	uint32_t		n;							// slots, a power of 2
+	uint32_t		size;							// bytes per item
+	volatile uint32_t	head;							// items put, only the producer writes it
+	volatile uint32_t	tail;							// items taken, only the consumer writes it
+	volatile TaskHandle_t	producer;						// waiting for room, NULL if not
+	volatile TaskHandle_t	consumer;						// waiting for an item, NULL if not
+};
+
+
+// Prototypes
+int		spsc_init(struct spsc_ring *r, uint32_t n, uint32_t size);
+int		spsc_put(struct spsc_ring *r, const void *item, TickType_t wait);
+int		spsc_get(struct spsc_ring *r, void *item, TickType_t wait);
@@ -0,0 +1,65 @@
+/*
+ * vncc_copyrect.c
+ * CopyRect encoding (1) for the VNC client (vncc)
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+/*
+	CopyRect is 4 bytes on the wire, the source x,y of pixels the client already has.
+	Scrolling and window drags become a move of pixels already on the panel rather than
+	resending them.  The pixels are read back from the ili9341 (jag_copy_rect()), so the
+	server is only offered CopyRect when jag says readback is possible.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include "screen_driver.h"
+#include "lcd_vncc.h"
+#include "jag.h"
+#include "vncc_rx.h"
+#include "vncc_decode.h"
+#include "endian.h"
+
+extern const char	*TAG;
+
+
+struct __attribute__ ((__packed__)) vnc_copyrect
+{
+	uint16_t	src_xpos;
+	uint16_t	src_ypos;
+};
+
+
+
+int vncc_decode_copyrect(struct vnc_rect *rec)
+{
+	struct vnc_copyrect	cr;
+	int			dw = jag_get_display_width();
+	int			dh = jag_get_display_height();
+
+	if (vncc_rx_read(&cr, sizeof(struct vnc_copyrect)) != sizeof(struct vnc_copyrect))
+		return(-1);
+	cr.src_xpos = bswap16(cr.src_xpos);
+	cr.src_ypos = bswap16(cr.src_ypos);
+	if (cr.src_xpos+rec->width > dw || cr.src_ypos+rec->height > dh)			// still in sync, just skip it
+		ESP_LOGE(TAG,"vncc_decode_copyrect() source %d,%d clips display", cr.src_xpos, cr.src_ypos);
+	else if (jag_copy_rect(cr.src_xpos, cr.src_ypos, rec->xpos, rec->ypos, rec->width, rec->height) != TRUE)
+		ESP_LOGE(TAG,"vncc_decode_copyrect() display readback failed");
+	return(0);
+}
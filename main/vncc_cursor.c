@@ -0,0 +1,244 @@
+/*
+ * vncc_cursor.c
+ * Locally drawn pointer for the VNC client (vncc), Cursor and PointerPos pseudo-encodings
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+/*
+	Once the server knows we take the Cursor pseudo-encoding (RFC 6143 7.8.1) it stops drawing
+	the pointer into its framebuffer and sends the cursor image once, as a rectangle whose x,y
+	is the hotspot followed by the pixels and a 1 bit per pixel mask.  We then draw it
+	ourselves, so moving the pointer is a small SPI write instead of a FramebufferUpdate.
+
+	The pixels under the cursor are read back from the panel (jag_read_bitmap) before it is
+	drawn and put back when it moves, so this is only offered when the panel can be read.
+
+	While a FramebufferUpdate is being drawn the cursor is taken off the screen only if a
+	rectangle overlaps it (or is a CopyRect, which might copy it) and put back at the end.
+	Touches read while vnc_task waits for the rest of an update are held until the update ends.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include "screen_driver.h"
+#include "lcd_vncc.h"
+#include "jag.h"
+#include "vncc_rx.h"
+#include "vncc_stats.h"
+#include "vncc_cursor.h"
+#include "vncc_decode.h"
+
+#define CURSOR_MASKBYTES		((VNCC_CURSOR_MAX+7)/8)
+
+extern const char	*TAG;
+
+static uint16_t			cur_pix[VNCC_CURSOR_MAX*VNCC_CURSOR_MAX];
+static uint8_t			cur_mask[VNCC_CURSOR_MAX*CURSOR_MASKBYTES];
+static int			cur_w		= 0;						// 0 no cursor
+static int			cur_h		= 0;
+static int			hot_x		= 0;
+static int			hot_y		= 0;
+static int			pos_x		= 0;						// pointer position on the display
+static int			pos_y		= 0;
+
+static uint16_t			under[VNCC_CURSOR_MAX*VNCC_CURSOR_MAX];				// what the cursor is covering
+static uint16_t			comp[VNCC_CURSOR_MAX*VNCC_CURSOR_MAX];
+static int			drawn		= FALSE;
+static int			under_x, under_y, under_w, under_h;
+static int			in_update	= FALSE;
+
+
+
+// Put back what was under the cursor
+static void cursor_erase()
+{
+	if (drawn!=TRUE)
+		return;
+	jag_draw_bitmap(under_x, under_y, under_w, under_h, under);
+	drawn = FALSE;
+}
+
+
+
+// Save what is under the cursor and draw it at pos_x,pos_y
+static void cursor_draw()
+{
+	int	x0 = pos_x - hot_x;
+	int	y0 = pos_y - hot_y;
+	int	ox = 0;										// first cursor column/row on the display
+	int	oy = 0;
+	int	w  = cur_w;
+	int	h  = cur_h;
+	int	dw = jag_get_display_width();
+	int	dh = jag_get_display_height();
+	int	i, j;
+
+	if (drawn==TRUE || cur_w==0)
+		return;
+	if (x0<0)
+	{
+		ox = -x0;
+		x0 = 0;
+	}
+	if (y0<0)
+	{
+		oy = -y0;
+		y0 = 0;
+	}
+	w = w - ox;
+	h = h - oy;
+	if (x0+w > dw)
+		w = dw - x0;
+	if (y0+h > dh)
+		h = dh - y0;
+	if (w<=0 || h<=0)									// off screen
+		return;
+	if (jag_read_bitmap(x0, y0, w, h, under)!=TRUE)
+		return;
+	for (j=0;j<h;j++)
+	{
+		for (i=0;i<w;i++)
+		{
+			if ((cur_mask[((oy+j)*CURSOR_MASKBYTES)+((ox+i)>>3)] & (0x80>>((ox+i)&7))) != 0)
+				comp[(j*w)+i] = cur_pix[((oy+j)*VNCC_CURSOR_MAX)+ox+i];
+			else	comp[(j*w)+i] = under[(j*w)+i];
+		}
+	}
+	jag_draw_bitmap(x0, y0, w, h, comp);
+	under_x = x0;
+	under_y = y0;
+	under_w = w;
+	under_h = h;
+	drawn = TRUE;
+	vncc_stats.cursor_draws++;
+}
+
+
+
+// New connection, no cursor until the server sends one
+void vncc_cursor_reset()
+{
+	cur_w = 0;
+	cur_h = 0;
+	drawn = FALSE;										// the screen is about to be redrawn anyway
+	in_update = FALSE;
+}
+
+
+
+// The screen under the cursor was cleared, what was saved from under it must not be put back.
+// The cursor shape is kept, it is drawn again at the end of the update
+void vncc_cursor_lost()
+{
+	drawn = FALSE;
+}
+
+
+
+// Cursor pseudo-encoding, rec x,y is the hotspot. Always inside a FramebufferUpdate
+int vncc_decode_cursor(struct vnc_rect *rec)
+{
+	uint8_t		*p  = NULL;
+	int		bpp = vncc_si.pf_bpp / 8;
+	int		mlen = (rec->width+7) / 8;
+	int		w = rec->width;
+	int		h = rec->height;
+	int		x, y;
+
+	if (w > VNCC_CURSOR_MAX)
+		w = VNCC_CURSOR_MAX;
+	if (h > VNCC_CURSOR_MAX)
+		h = VNCC_CURSOR_MAX;
+
+	cursor_erase();
+	cur_w = 0;										// no cursor if the read fails
+	for (y=0;y<rec->height;y++)								// pixels a line at a time
+	{
+		if ((p = vncc_rx_need(rec->width*bpp)) == NULL)
+			goto fail;
+		for (x=0;x<w && y<h;x++)
+			cur_pix[(y*VNCC_CURSOR_MAX)+x] = vncc_pixel(p+(x*bpp));
+		vncc_rx_consume(rec->width*bpp);
+	}
+	for (y=0;y<rec->height;y++)								// then the mask
+	{
+		if ((p = vncc_rx_need(mlen)) == NULL)
+			goto fail;
+		if (y<h)
+			memcpy(&cur_mask[y*CURSOR_MASKBYTES], p, (w+7)/8);
+		vncc_rx_consume(mlen);
+	}
+	cur_w = w;
+	cur_h = h;
+	hot_x = rec->xpos;
+	hot_y = rec->ypos;
+	return(0);
+
+fail:
+	return(-1);
+}
+
+
+
+// The pointer moved, either we sent a PointerEvent or the server sent PointerPos
+void vncc_cursor_move(int x, int y)
+{
+	if (x!=pos_x || y!=pos_y)
+	{
+		if (in_update!=TRUE)								// otherwise moved when the update ends
+			cursor_erase();
+		pos_x = x;
+		pos_y = y;
+		if (in_update!=TRUE)
+			cursor_draw();
+	}
+}
+
+
+
+// A FramebufferUpdate is starting
+void vncc_cursor_update_start()
+{
+	in_update = TRUE;
+}
+
+
+
+// A rectangle is about to be drawn, take the cursor off the screen if it is in the way
+void vncc_cursor_rect(struct vnc_rect *rec)
+{
+	if (drawn==TRUE)
+	{
+		if (rec->encoding_type==VNC_ET_COPYRECT ||
+		    (rec->xpos < under_x+under_w && rec->xpos+rec->width > under_x &&
+		     rec->ypos < under_y+under_h && rec->ypos+rec->height > under_y))
+			cursor_erase();
+	}
+}
+
+
+
+// The FramebufferUpdate is drawn, put the cursor back or move it if it moved meanwhile
+void vncc_cursor_update_end()
+{
+	in_update = FALSE;
+	if (drawn==TRUE && (under_x != pos_x-hot_x || under_y != pos_y-hot_y))		// moved, clipped ones redraw anyway
+		cursor_erase();
+	cursor_draw();
+}
@@ -0,0 +1,29 @@
+/*
+ * vncc_cursor.h
+ * Locally drawn pointer for the VNC client (vncc), Cursor and PointerPos pseudo-encodings
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+#define VNCC_CURSOR_MAX				32					// larger cursors are cropped to this
+
+
+// Prototypes
+void	vncc_cursor_reset();
+void	vncc_cursor_lost();
+int	vncc_decode_cursor(struct vnc_rect *rec);
+void	vncc_cursor_move(int x, int y);
+void	vncc_cursor_update_start();
+void	vncc_cursor_rect(struct vnc_rect *rec);
+void	vncc_cursor_update_end();
@@ -0,0 +1,113 @@
+/*
+ * vncc_decode.h
+ * Rectangle decoders for the VNC client (vncc)
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+// One decoder per encoding type.  Each is called from vncc_process_rectangle() once the
+// rectangle header has been read and checked against the display size, it reads the
+// rest of the rectangle from the receive buffer (vncc_rx.c) and draws it.
+// All return 0 on success or -1 if the connection failed or the data made no sense, in
+// which case the caller can no longer trust where it is in the stream.
+
+
+#define VNCC_LUT_DITHER				4					// 8 bit tables, one per 2x2 dither position
+
+
+extern struct vnc_ServerInit	vncc_si;							// pixel format the server is sending
+extern int			vncc_bpp;							// bytes per pixel on the wire (vncc_pixel.c)
+extern uint16_t			vncc_lut[VNCC_LUT_DITHER][256];
+
+
+// 32 bit true colour, right shifts that leave the top 5 (green 6) bits of each channel at the bottom
+struct vncc_pf32
+{
+	uint8_t		rshift;
+	uint8_t		gshift;
+	uint8_t		bshift;
+	uint8_t		scale;									// channels narrower than RGB565, scaled the slow way
+};
+
+extern struct vncc_pf32		vncc_pf32;
+
+
+// Big endian (network order) values that may not be aligned, Xtensa faults on unaligned word loads
+static inline uint16_t vncc_be16(const uint8_t *p)
+{
+	return((p[0]<<8) | p[1]);
+}
+
+static inline uint32_t vncc_be32(const uint8_t *p)
+{
+	return(((uint32_t)p[0]<<24) | (p[1]<<16) | (p[2]<<8) | p[3]);
+}
+
+static inline uint32_t vncc_le32(const uint8_t *p)
+{
+	return(p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24));
+}
+
+
+uint16_t vncc_pixel_scale(uint32_t v);
+
+// 32 bit server pixel value to RGB565
+static inline uint16_t vncc_pixel32(uint32_t v)
+{
+	if (vncc_pf32.scale!=0)
+		return(vncc_pixel_scale(v));
+	return((((v >> vncc_pf32.rshift) & 0x1F) << 11) | (((v >> vncc_pf32.gshift) & 0x3F) << 5) |
+		((v >> vncc_pf32.bshift) & 0x1F));
+}
+
+
+// The server pixel value as sent, 1, 2 or 4 bytes in server byte order
+static inline uint32_t vncc_pixel_value(const uint8_t *p)
+{
+	if (vncc_bpp==1)
+		return(p[0]);
+	if (vncc_bpp==4)
+		return((vncc_si.pf_bigendian!=0) ? vncc_be32(p) : vncc_le32(p));
+	if (vncc_si.pf_bigendian!=0)
+		return((p[0]<<8) | p[1]);
+	return(p[0] | (p[1]<<8));
+}
+
+
+// Pixel on the wire to the RGB565 value jag draws, RGB565 in server byte order, 8 bit through the table
+// or 32 bit true colour
+static inline uint16_t vncc_pixel(const uint8_t *p)
+{
+	if (vncc_bpp==1)
+		return(vncc_lut[0][p[0]]);
+	if (vncc_bpp==4)
+		return(vncc_pixel32(vncc_pixel_value(p)));
+	if (vncc_si.pf_bigendian!=0)
+		return((p[0]<<8) | p[1]);
+	return(p[0] | (p[1]<<8));
+}
+
+
+// Prototypes
+void vncc_pixel_format(int dither);
+void vncc_pixel_draw_lines(uint16_t *buf, int w, int h, int x, int y);
+void vncc_pixel_colourmap(int first, int n, const uint8_t *rgb);
+int vncc_decode_copyrect(struct vnc_rect *rec);
+int vncc_decode_rre(struct vnc_rect *rec, int compact);
+int vncc_decode_hextile(struct vnc_rect *rec);
+int vncc_decode_tight(struct vnc_rect *rec);
+int vncc_decode_trle(struct vnc_rect *rec);
+int vncc_decode_zrle(struct vnc_rect *rec);
+void vncc_zrle_free();
+void vncc_tight_free();
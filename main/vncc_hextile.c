@@ -0,0 +1,182 @@
+/*
+ * vncc_hextile.c
+ * Hextile encoding (5) for the VNC client (vncc)
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+/*
+	The rectangle is sent as 16x16 tiles, left to right then top to bottom, the last
+	row and column may be smaller.  Each tile starts with a subencoding mask byte.
+	Background and foreground colours carry over from one tile to the next unless the
+	tile sends new ones, so they live for the whole rectangle.
+
+	Every tile is built in a flush buffer (jag_flush_get) and queued for the LCD as one
+	transfer, subrects (coloured or not) are only ever written into the buffer.  The next
+	tile is decoded while it is sent.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include "screen_driver.h"
+#include "lcd_vncc.h"
+#include "jag.h"
+#include "vncc_rx.h"
+#include "vncc_stats.h"
+#include "vncc_decode.h"
+
+#define HEXTILE_SIZE			16
+
+// Tile subencoding mask bits
+#define HEXTILE_RAW			1
+#define HEXTILE_BACKGROUNDSPECIFIED	2
+#define HEXTILE_FOREGROUNDSPECIFIED	4
+#define HEXTILE_ANYSUBRECTS		8
+#define HEXTILE_SUBRECTSCOLOURED	16
+
+extern const char	*TAG;
+
+
+
+// Decode one tile of tw x th pixels into tile, bg and fg are updated when the tile specifies them
+static int hextile_tile(uint16_t *tile, int tw, int th, uint16_t *bg, uint16_t *fg)
+{
+	uint8_t		*p   = NULL;
+	uint8_t		mask = 0;
+	uint16_t	*t   = NULL;
+	uint16_t	c    = 0;
+	int		ns   = 0;								// number of subrects
+	int		srlen= 0;
+	int		i, x, y, sx, sy, sw, sh;
+
+	p = vncc_rx_need(1);
+	if (p==NULL)
+		return(-1);
+	mask = *p;
+	vncc_rx_consume(1);
+
+	if ((mask & HEXTILE_RAW) != 0)								// raw pixels, nothing else follows
+	{
+		p = vncc_rx_need(tw*th*vncc_bpp);
+		if (p==NULL)
+			return(-1);
+		for (i=0;i<tw*th;i++)
+		{
+			tile[i] = vncc_pixel(p);
+			p = p + vncc_bpp;
+		}
+		vncc_rx_consume(tw*th*vncc_bpp);
+		vncc_stats.hextile_raw_tiles++;
+		return(0);
+	}
+
+	if ((mask & HEXTILE_BACKGROUNDSPECIFIED) != 0)
+	{
+		if ((p = vncc_rx_need(vncc_bpp)) == NULL)
+			return(-1);
+		*bg = vncc_pixel(p);
+		vncc_rx_consume(vncc_bpp);
+	}
+	if ((mask & HEXTILE_FOREGROUNDSPECIFIED) != 0)
+	{
+		if ((p = vncc_rx_need(vncc_bpp)) == NULL)
+			return(-1);
+		*fg = vncc_pixel(p);
+		vncc_rx_consume(vncc_bpp);
+	}
+	for (i=0;i<tw*th;i++)
+		tile[i] = *bg;
+	if ((mask & HEXTILE_ANYSUBRECTS) == 0)
+	{
+		vncc_stats.hextile_solid_tiles++;
+		return(0);
+	}
+
+	if ((p = vncc_rx_need(1)) == NULL)
+		return(-1);
+	ns = *p;
+	vncc_rx_consume(1);
+	srlen = 2;
+	if ((mask & HEXTILE_SUBRECTSCOLOURED) != 0)
+		srlen = srlen + vncc_bpp;
+	if ((p = vncc_rx_need(ns*srlen)) == NULL)						// all the subrects at once, at most 1K
+		return(-1);
+	c = *fg;
+	for (i=0;i<ns;i++)
+	{
+		if ((mask & HEXTILE_SUBRECTSCOLOURED) != 0)
+		{
+			c = vncc_pixel(p);
+			p = p + vncc_bpp;
+		}
+		sx = p[0] >> 4;
+		sy = p[0] & 0x0F;
+		sw = (p[1] >> 4) + 1;
+		sh = (p[1] & 0x0F) + 1;
+		p = p + 2;
+		if (sx+sw > tw || sy+sh > th)
+		{
+			ESP_LOGE(TAG,"hextile_tile() subrect %d,%d %dx%d outside %dx%d tile", sx, sy, sw, sh, tw, th);
+			return(-1);
+		}
+		for (y=sy;y<sy+sh;y++)
+		{
+			t = &tile[(y*tw)+sx];
+			for (x=0;x<sw;x++)
+				*t++ = c;
+		}
+	}
+	vncc_rx_consume(ns*srlen);
+	vncc_stats.hextile_subrect_tiles++;
+	vncc_stats.hextile_subrects += ns;
+	return(0);
+}
+
+
+
+int vncc_decode_hextile(struct vnc_rect *rec)
+{
+	uint16_t	bg = 0;
+	uint16_t	fg = 0;
+	int		tx = 0;
+	int		ty = 0;
+	int		tw = 0;
+	int		th = 0;
+	uint16_t	*tile = NULL;
+
+	for (ty=0;ty<rec->height;ty=ty+HEXTILE_SIZE)
+	{
+		th = rec->height-ty;
+		if (th > HEXTILE_SIZE)
+			th = HEXTILE_SIZE;
+		for (tx=0;tx<rec->width;tx=tx+HEXTILE_SIZE)
+		{
+			tw = rec->width-tx;
+			if (tw > HEXTILE_SIZE)
+				tw = HEXTILE_SIZE;
+			tile = jag_flush_get();
+			if (hextile_tile(tile, tw, th, &bg, &fg) != 0)
+			{
+				jag_flush_cancel(tile);
+				return(-1);
+			}
+			jag_flush_put(rec->xpos+tx, rec->ypos+ty, tw, th, tile, FALSE);
+		}
+	}
+	return(0);
+}
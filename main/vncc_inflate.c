@@ -0,0 +1,315 @@
+/*
+ * vncc_inflate.c
+ * Persistent zlib streams for the VNC client (vncc), using the miniz tinfl in ESP32 ROM
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+/*
+	Zlib based encodings send a 4 byte length then that many bytes of one long deflate stream
+	that started with the first rectangle of the connection, RFC 6143 7.7.6.  The server flushes
+	at the end of each rectangle so everything for the rectangle can be inflated from its bytes.
+
+	tinfl from the ESP32 ROM does the work, so no flash is used for an inflate library.  It is
+	run in wrapping mode, writing into a 32K circular dictionary that also holds the history it
+	needs for back references.  Decoders read inflated bytes straight out of the dictionary with
+	vncc_inflate_need()/vncc_inflate_consume(), tinfl is only run again once they have used up
+	what it last produced.  tinfl insists on being given the dictionary from its write position
+	to the end, so a request that needs more than is left has the leftover moved to a small stage
+	first.  The RAM cost is fixed at the dictionary plus the decompressor state.
+
+	A stream cannot share its dictionary, it holds the history for the next rectangle, so each
+	one costs about 43K for as long as the connection lasts.  Encodings are only offered when
+	the heap has room for all the streams they can use (vncc_inflate_room), and a stream is
+	never allocated into the last VNCC_INFLATE_RESERVE bytes.
+
+	Compressed bytes are handed to tinfl directly from the receive buffer (vncc_rx.c).
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp32/rom/miniz.h"
+
+#include "lcd_vncc.h"
+#include "vncc_rx.h"
+#include "vncc_stats.h"
+#include "vncc_inflate.h"
+
+#define INFLATE_FLAGS		(TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT)
+#define INFLATE_STREAM_RAM	(sizeof(tinfl_decompressor) + TINFL_LZ_DICT_SIZE)
+
+extern const char	*TAG;
+static uint32_t		inflate_ram	= 0;						// bytes currently allocated for all streams
+
+
+
+// How many more streams the heap has room for, keeping VNCC_INFLATE_RESERVE free
+int vncc_inflate_room()
+{
+	uint32_t	free = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+
+	if (free < VNCC_INFLATE_RESERVE || heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) < TINFL_LZ_DICT_SIZE)
+		return(0);
+	return((free - VNCC_INFLATE_RESERVE) / INFLATE_STREAM_RAM);
+}
+
+
+
+// Allocate the stream the first time it is used, returns 0 or -1 if out of memory
+int vncc_inflate_init(struct vncc_inflate *z)
+{
+	if (z->decomp != NULL)
+		return(0);
+	if (vncc_inflate_room() < 1)
+	{
+		ESP_LOGE(TAG,"vncc_inflate_init() %u bytes of heap free, a stream needs %d and %d is kept for the network",
+			heap_caps_get_free_size(MALLOC_CAP_8BIT), INFLATE_STREAM_RAM, VNCC_INFLATE_RESERVE);
+		return(-1);
+	}
+	bzero(z, sizeof(struct vncc_inflate));
+	z->decomp = malloc(sizeof(tinfl_decompressor));
+	z->dict   = malloc(TINFL_LZ_DICT_SIZE);
+	if (z->decomp==NULL || z->dict==NULL)
+	{
+		ESP_LOGE(TAG,"vncc_inflate_init() could not allocate %d bytes", INFLATE_STREAM_RAM);
+		free(z->decomp);
+		free(z->dict);
+		bzero(z, sizeof(struct vncc_inflate));
+		return(-1);
+	}
+	tinfl_init(z->decomp);
+	inflate_ram = inflate_ram + INFLATE_STREAM_RAM;
+	return(0);
+}
+
+
+
+// Called when the connection closes, the next connection starts a new stream
+void vncc_inflate_free(struct vncc_inflate *z)
+{
+	if (z->decomp==NULL)
+		return;
+	inflate_ram = inflate_ram - INFLATE_STREAM_RAM;
+	free(z->decomp);
+	free(z->dict);
+	bzero(z, sizeof(struct vncc_inflate));
+}
+
+
+
+// Start the stream again from a new zlib header (Tight can ask for this), keeps the memory
+void vncc_inflate_reset(struct vncc_inflate *z)
+{
+	if (z->decomp==NULL)
+		return;
+	tinfl_init(z->decomp);
+	z->dict_ofs  = 0;
+	z->out_rd    = 0;
+	z->out_avail = 0;
+	z->in_left   = 0;
+	z->failed    = FALSE;
+	z->stage_rd  = 0;
+	z->stage_len = 0;
+}
+
+
+
+// len compressed bytes follow in the receive buffer
+void vncc_inflate_begin(struct vncc_inflate *z, uint32_t len)
+{
+	z->in_left = len;
+}
+
+
+
+// Run tinfl once, giving it whatever compressed bytes are already buffered (blocking for at least one).
+// Only called once all of its previous output has been used or staged
+static int vncc_inflate_more(struct vncc_inflate *z)
+{
+	tinfl_status	status;
+	uint8_t		*p    = NULL;
+	size_t		in_n  = 0;
+	size_t		out_n = 0;
+	int64_t		st    = 0;
+
+	if (z->failed==TRUE)
+		return(-1);
+	if (z->in_left > 0)
+	{
+		p = vncc_rx_need(1);
+		if (p==NULL)
+			return(-1);
+		in_n = vncc_rx_available();
+		if (in_n > z->in_left)
+			in_n = z->in_left;
+	}
+
+	out_n = TINFL_LZ_DICT_SIZE - z->dict_ofs;
+	st = esp_timer_get_time();
+	status = tinfl_decompress(z->decomp, p, &in_n, z->dict, &z->dict[z->dict_ofs], &out_n, INFLATE_FLAGS);
+	vncc_stats.inflate_us += esp_timer_get_time() - st;
+	if (in_n > 0)
+		vncc_rx_consume(in_n);
+	z->in_left   = z->in_left - in_n;
+	z->out_rd    = z->dict_ofs;
+	z->out_avail = out_n;
+	z->dict_ofs  = (z->dict_ofs + out_n) & (TINFL_LZ_DICT_SIZE-1);
+	vncc_stats.inflate_in  += in_n;
+	vncc_stats.inflate_out += out_n;
+
+	if (status < TINFL_STATUS_DONE)
+	{
+		ESP_LOGE(TAG,"vncc_inflate_more() tinfl failed %d", status);
+		z->failed = TRUE;
+		return(-1);
+	}
+	if (out_n==0 && in_n==0)								// no progress possible
+	{
+		ESP_LOGE(TAG,"vncc_inflate_more() ran out of compressed data, status %d", status);
+		z->failed = TRUE;
+		return(-1);
+	}
+	return(0);
+}
+
+
+
+// Move n bytes from the dictionary to the end of the stage, running tinfl when it has nothing
+static int vncc_inflate_stage(struct vncc_inflate *z, int n)
+{
+	int	c = 0;
+
+	while (n>0)
+	{
+		if (z->out_avail==0 && vncc_inflate_more(z)!=0)
+			return(-1);
+		c = n;
+		if (c > z->out_avail)
+			c = z->out_avail;
+		if (c > TINFL_LZ_DICT_SIZE - z->out_rd)
+			c = TINFL_LZ_DICT_SIZE - z->out_rd;
+		memcpy(&z->stage[z->stage_len], &z->dict[z->out_rd], c);
+		z->stage_len = z->stage_len + c;
+		z->out_rd    = (z->out_rd + c) & (TINFL_LZ_DICT_SIZE-1);
+		z->out_avail = z->out_avail - c;
+		n = n - c;
+	}
+	return(0);
+}
+
+
+
+// Returns a pointer to the next n inflated bytes without using them, NULL on error. n <= VNCC_INFLATE_MAXNEED
+uint8_t* vncc_inflate_need(struct vncc_inflate *z, int n)
+{
+	int	staged = z->stage_len - z->stage_rd;
+
+	if (n > VNCC_INFLATE_MAXNEED)
+		return(NULL);
+	if (staged==0 && z->out_avail >= n && z->out_rd + n <= TINFL_LZ_DICT_SIZE)	// the usual case, use it in place
+		return(&z->dict[z->out_rd]);
+	if (staged >= n)
+		return(&z->stage[z->stage_rd]);
+
+	memmove(&z->stage[0], &z->stage[z->stage_rd], staged);				// build it up in the stage
+	z->stage_rd  = 0;
+	z->stage_len = staged;
+	if (vncc_inflate_stage(z, n-staged)!=0)
+		return(NULL);
+	return(&z->stage[0]);
+}
+
+
+
+void vncc_inflate_consume(struct vncc_inflate *z, int n)
+{
+	int	c = z->stage_len - z->stage_rd;
+
+	if (c > 0)										// staged bytes come first
+	{
+		if (c > n)
+			c = n;
+		z->stage_rd = z->stage_rd + c;
+		if (z->stage_rd == z->stage_len)
+		{
+			z->stage_rd  = 0;
+			z->stage_len = 0;
+		}
+		n = n - c;
+	}
+	z->out_rd    = (z->out_rd + n) & (TINFL_LZ_DICT_SIZE-1);
+	z->out_avail = z->out_avail - n;
+}
+
+
+
+// Copy n inflated bytes to buf, any size. Returns n or -1 on error
+int vncc_inflate_read(struct vncc_inflate *z, void *buf, int n)
+{
+	uint8_t	*p = NULL;
+	int	c = 0;
+	int	done = 0;
+
+	while (done<n)
+	{
+		c = n-done;
+		if (c > VNCC_INFLATE_MAXNEED)
+			c = VNCC_INFLATE_MAXNEED;
+		p = vncc_inflate_need(z, c);
+		if (p==NULL)
+			return(-1);
+		memcpy((uint8_t*)buf+done, p, c);
+		vncc_inflate_consume(z, c);
+		done = done + c;
+	}
+	return(n);
+}
+
+
+
+// Finished with the rectangle, any compressed bytes left (normally just the flush marker) still
+// have to go through tinfl to keep the stream in step.  Returns 0 or -1 on error
+int vncc_inflate_end(struct vncc_inflate *z)
+{
+	uint32_t	unused = 0;
+
+	unused = (z->stage_len - z->stage_rd) + z->out_avail;
+	z->stage_rd  = 0;
+	z->stage_len = 0;
+	z->out_avail = 0;
+	while (z->in_left > 0)
+	{
+		if (vncc_inflate_more(z)!=0)
+			return(-1);
+		unused = unused + z->out_avail;							// nothing should be produced now
+		z->out_avail = 0;
+	}
+	if (unused > 0)
+		ESP_LOGE(TAG,"vncc_inflate_end() %u inflated bytes unused", unused);
+	return(0);
+}
+
+
+
+// Heap used by all streams, for the RAM report
+uint32_t vncc_inflate_ram()
+{
+	return(inflate_ram);
+}
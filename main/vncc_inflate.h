@@ -0,0 +1,50 @@
+/*
+ * vncc_inflate.h
+ * Persistent zlib streams for the VNC client (vncc), using the miniz tinfl in ESP32 ROM
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+#define VNCC_INFLATE_MAXNEED			256					// largest vncc_inflate_need() request
+#define VNCC_INFLATE_RESERVE			(48*1024)				// heap a new stream must leave for Wi-Fi and lwIP
+
+
+// One zlib stream.  The server keeps its deflate stream going for the whole connection so this does too,
+// the 32K tinfl dictionary doubles as the window inflated bytes are read from
+struct vncc_inflate
+{
+	tinfl_decompressor	*decomp;							// heap, about 11K
+	uint8_t			*dict;								// heap, TINFL_LZ_DICT_SIZE circular output
+	uint32_t		dict_ofs;							// where tinfl writes next
+	uint32_t		out_rd;								// first inflated byte not yet used
+	uint32_t		out_avail;							// inflated bytes not yet used
+	uint32_t		in_left;							// compressed bytes of this rectangle not yet given to tinfl
+	int			failed;								// TRUE once the stream is broken
+	uint8_t			stage[VNCC_INFLATE_MAXNEED];					// bytes taken out of dict ahead of a request
+	int			stage_rd;							// that straddles its end or what tinfl last made
+	int			stage_len;
+};
+
+
+// Prototypes
+int	 vncc_inflate_init(struct vncc_inflate *z);
+void	 vncc_inflate_free(struct vncc_inflate *z);
+void	 vncc_inflate_reset(struct vncc_inflate *z);
+void	 vncc_inflate_begin(struct vncc_inflate *z, uint32_t len);
+uint8_t* vncc_inflate_need(struct vncc_inflate *z, int n);
+void	 vncc_inflate_consume(struct vncc_inflate *z, int n);
+int	 vncc_inflate_read(struct vncc_inflate *z, void *buf, int n);
+int	 vncc_inflate_end(struct vncc_inflate *z);
+uint32_t vncc_inflate_ram();
+int	 vncc_inflate_room();
@@ -0,0 +1,125 @@
+/*
+ * vncc_pace.c
+ * FramebufferUpdateRequest pacing for the VNC client (vncc)
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+/*
+	While polling, the next FramebufferUpdateRequest is timed so the update it asks for arrives
+	as the one being drawn is finished.  Three things are measured per update and smoothed
+	(1/8 new sample, as TCP does for its RTT):
+
+	  rtt     request sent to the FramebufferUpdate header read.  Over estimates while the
+		  client is still drawing the update before, which only makes it ask sooner
+	  decode  time in vnc_task that was neither network wait nor waiting for the LCD
+	  flush   time the LCD was busy during the update, overlapped with decode (jag.c)
+
+	An update costs the larger of decode and flush, so the request goes that long after the
+	header less one rtt.  A cheap update (typing, a cursor blink) gives no delay and the rate is
+	then set by the round trip, capped at VNCC_PACE_CEILING_HZ.  A costly one (video) holds the
+	request back so the link is not filled with updates that would only queue, but never for
+	longer than VNCC_PACE_FLOOR_HZ allows.  An incremental request on a still screen is held by
+	the server until something changes, so pacing never costs packets while idle.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "screen_driver.h"
+#include "lcd_vncc.h"
+#include "vncc_stats.h"
+#include "vncc_pace.h"
+
+static int64_t		pace_requested	= 0;						// last request sent
+static int64_t		pace_header	= 0;						// last FramebufferUpdate header read
+static int		pace_timing	= FALSE;					// a request is waiting for its rtt sample
+
+
+
+// Smooth a sample into avg, the first sample is taken as it is
+static uint32_t pace_smooth(uint32_t avg, uint32_t sample)
+{
+	if (avg==0)
+		return(sample);
+	return(avg - (avg/8) + (sample/8));
+}
+
+
+
+// New connection, nothing measured yet so the first requests go straight away
+void vncc_pace_reset()
+{
+	pace_requested	= 0;
+	pace_header	= 0;
+	pace_timing	= FALSE;
+}
+
+
+
+// A FramebufferUpdateRequest has been sent
+void vncc_pace_request()
+{
+	pace_requested = esp_timer_get_time();
+	pace_timing = TRUE;
+}
+
+
+
+// A FramebufferUpdate header has been read (vnc_task)
+void vncc_pace_answered()
+{
+	pace_header = esp_timer_get_time();
+	if (pace_timing==TRUE)
+	{
+		vncc_stats.pace_rtt_us = pace_smooth(vncc_stats.pace_rtt_us, (uint32_t)(pace_header - pace_requested));
+		pace_timing = FALSE;
+	}
+}
+
+
+
+// The update is drawn, decode_us of vnc_task time went on decoding and the LCD was busy for flush_us
+void vncc_pace_drawn(uint32_t decode_us, uint32_t flush_us)
+{
+	vncc_stats.pace_decode_us = pace_smooth(vncc_stats.pace_decode_us, decode_us);
+	vncc_stats.pace_flush_us  = pace_smooth(vncc_stats.pace_flush_us, flush_us);
+}
+
+
+
+// Earliest esp_timer_get_time() for the next request
+int64_t vncc_pace_next()
+{
+	int64_t		cost  = vncc_stats.pace_decode_us;
+	int64_t		delay = 0;
+	int64_t		next  = 0;
+
+	if (vncc_stats.pace_flush_us > cost)							// decode and SPI overlap, the slower one sets the pace
+		cost = vncc_stats.pace_flush_us;
+	delay = cost - vncc_stats.pace_rtt_us;
+	if (delay < 0)
+		delay = 0;
+	if (delay > 1000000/VNCC_PACE_FLOOR_HZ)
+		delay = 1000000/VNCC_PACE_FLOOR_HZ;
+	next = pace_header + delay;
+	if (next < pace_requested + (1000000/VNCC_PACE_CEILING_HZ))
+		next = pace_requested + (1000000/VNCC_PACE_CEILING_HZ);
+	vncc_stats.pace_delay_us = (uint32_t)delay;
+	return(next);
+}
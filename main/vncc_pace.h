@@ -0,0 +1,28 @@
+/*
+ * vncc_pace.h
+ * FramebufferUpdateRequest pacing for the VNC client (vncc)
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+#define VNCC_PACE_FLOOR_HZ			2					// never wait longer than this allows between requests
+#define VNCC_PACE_CEILING_HZ			60					// never ask more often than this
+
+
+// Prototypes
+void	vncc_pace_reset();
+void	vncc_pace_request();
+void	vncc_pace_answered();
+void	vncc_pace_drawn(uint32_t decode_us, uint32_t flush_us);
+int64_t	vncc_pace_next();
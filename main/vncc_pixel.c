@@ -0,0 +1,277 @@
+/*
+ * vncc_pixel.c
+ * Server pixel format to the RGB565 jag draws (vncc)
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+/*
+	Normally the server is asked for big endian RGB565, the byte order the ili9341 takes, so RAW
+	and Zlib lines go from the receive buffer to the SPI DMA without a pass over the pixels
+	(the flush task in jag.c).  Little endian RGB565 is swapped by jag on the way out.  Where the
+	link is slower than the SPI bus the client can ask for 8 bit BGR233 instead (SetPixelFormat),
+	3 bits red, 3 green and 2 blue in one byte, half the bytes of RGB565.  8 bit pixels are
+	expanded through a 256 entry table, one load per pixel.  The tables are in DRAM, IRAM
+	only allows 32 bit loads.
+
+	The optional dither is a 2x2 ordered dither done while expanding, each of the four tables
+	puts the colour at a different point inside the range the server rounded it from.  It
+	cannot bring back the lost bits but turns the bands in a gradient into a fine pattern.
+	Only RAW and Zlib lines are dithered, the other decoders use the first table.
+
+	In colour map mode (true colour off) the table is the servers palette, filled by
+	SetColourMapEntries, so every pixel is exact.
+
+	A 24 bit server is asked for RGB565 like any other.  If it is left to send its own 32 bit
+	pixels (VNCC_PF_SERVER) RAW and Zlib lines are converted a word at a time straight into the
+	panels byte order, in place, using the top bits of each channel from pf_shift and pf_max.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "screen_driver.h"
+#include "lcd_vncc.h"
+#include "jag.h"
+#include "vncc_stats.h"
+#include "vncc_decode.h"
+
+extern const char	*TAG;
+
+int			vncc_bpp	= 2;							// bytes per pixel on the wire
+uint16_t		vncc_lut[VNCC_LUT_DITHER][256];						// 8 bit pixel to RGB565
+struct vncc_pf32	vncc_pf32;
+static int		pixel_dither	= FALSE;
+
+static const uint8_t	bayer[VNCC_LUT_DITHER] = { 0, 2, 3, 1 };				// 2x2 threshold, [y&1][x&1]
+
+
+
+// Scale channel c of 0 to max to bits wide, t is the dither threshold 0 to 3 or -1 for the nearest value
+static uint16_t pixel_channel(uint32_t c, uint16_t max, int bits, int t)
+{
+	int32_t		m = (1<<bits)-1;
+	int32_t		v = 0;
+
+	if (max==0)
+		return(0);
+	if (t<0)
+		return(((c*m) + (max/2)) / max);
+	v = ((((int32_t)c*8) + (2*t) - 3) * m + (max*4)) / (max*8);				// c + (t-1.5)/4 of a step
+	if (v < 0)
+		v = 0;
+	if (v > m)
+		v = m;
+	return(v);
+}
+
+
+
+// 8 bit true colour tables from the pixel format in vncc_si
+static void pixel_build_lut()
+{
+	int	i, d, t;
+
+	for (d=0;d<VNCC_LUT_DITHER;d++)
+	{
+		t = -1;
+		if (pixel_dither==TRUE)
+			t = bayer[d];
+		for (i=0;i<256;i++)
+		{
+			vncc_lut[d][i] = (pixel_channel((i >> vncc_si.pf_shiftred)   & vncc_si.pf_maxred,   vncc_si.pf_maxred,   5, t) << 11) |
+					 (pixel_channel((i >> vncc_si.pf_shiftgreen) & vncc_si.pf_maxgreen, vncc_si.pf_maxgreen, 6, t) << 5)  |
+					  pixel_channel((i >> vncc_si.pf_shiftblue)  & vncc_si.pf_maxblue,  vncc_si.pf_maxblue,  5, t);
+		}
+	}
+}
+
+
+
+// Bits in a channel maximum of 2^n-1, 0 if it is not of that form
+static int pixel_bits(uint16_t max)
+{
+	int	n = 0;
+
+	while ((max & 1) != 0)
+	{
+		max = max >> 1;
+		n++;
+	}
+	if (max!=0)
+		return(0);
+	return(n);
+}
+
+
+
+// Shifts for the 32 bit true colour fast path, any channel narrower than RGB565 is scaled instead
+static void pixel_build_pf32()
+{
+	int	rb = pixel_bits(vncc_si.pf_maxred);
+	int	gb = pixel_bits(vncc_si.pf_maxgreen);
+	int	bb = pixel_bits(vncc_si.pf_maxblue);
+
+	vncc_pf32.scale = (rb<5 || gb<6 || bb<5);
+	if (vncc_pf32.scale!=0)
+		return;
+	vncc_pf32.rshift = vncc_si.pf_shiftred   + rb - 5;
+	vncc_pf32.gshift = vncc_si.pf_shiftgreen + gb - 6;
+	vncc_pf32.bshift = vncc_si.pf_shiftblue  + bb - 5;
+}
+
+
+
+// 32 bit pixel value to RGB565 for channels too narrow to shift down
+uint16_t vncc_pixel_scale(uint32_t v)
+{
+	return((pixel_channel((v >> vncc_si.pf_shiftred)   & vncc_si.pf_maxred,   vncc_si.pf_maxred,   5, -1) << 11) |
+	       (pixel_channel((v >> vncc_si.pf_shiftgreen) & vncc_si.pf_maxgreen, vncc_si.pf_maxgreen, 6, -1) << 5)  |
+	        pixel_channel((v >> vncc_si.pf_shiftblue)  & vncc_si.pf_maxblue,  vncc_si.pf_maxblue,  5, -1));
+}
+
+
+
+// The pixel format in vncc_si has changed, after ServerInit or SetPixelFormat. dither TRUE to dither 8 bit pixels
+void vncc_pixel_format(int dither)
+{
+	vncc_bpp = vncc_si.pf_bpp / 8;
+	pixel_dither = dither;
+	if (vncc_bpp==1 && vncc_si.pf_truecolor!=0)
+		pixel_build_lut();
+	else if (vncc_bpp==1)
+		bzero(&vncc_lut, sizeof(vncc_lut));						// black until the server sends its colours
+	if (vncc_bpp==4)
+		pixel_build_pf32();
+	ESP_LOGI(TAG,"pixel format %d bpp depth %d, max %d,%d,%d shift %d,%d,%d%s", vncc_si.pf_bpp, vncc_si.pf_depth,
+		vncc_si.pf_maxred, vncc_si.pf_maxgreen, vncc_si.pf_maxblue,
+		vncc_si.pf_shiftred, vncc_si.pf_shiftgreen, vncc_si.pf_shiftblue,
+		(vncc_bpp==1 && vncc_si.pf_truecolor!=0 && pixel_dither==TRUE) ? " dithered" : "");
+}
+
+
+
+// SetColourMapEntries, n colours of 3 big endian 16 bit values (R,G,B) for entries first onwards
+void vncc_pixel_colourmap(int first, int n, const uint8_t *rgb)
+{
+	uint16_t	c = 0;
+	int		i = 0;
+	int		d = 0;
+
+	for (i=0;i<n && first+i<256;i++)
+	{
+		c = ((rgb[0] & 0xF8) << 8) | ((rgb[2] & 0xFC) << 3) | (rgb[4] >> 3);		// top bits of each
+		for (d=0;d<VNCC_LUT_DITHER;d++)
+			vncc_lut[d][first+i] = c;
+		rgb = rgb + 6;
+	}
+}
+
+
+
+// n 8 bit pixels from in to RGB565 at out, x,y is where the first one goes on the display.
+// Works backwards so out may start at in, each pixel grows to 2 bytes
+static void pixel_expand(const uint8_t *in, uint16_t *out, int n, int x, int y)
+{
+	const uint16_t	*l0 = NULL;
+	const uint16_t	*l1 = NULL;
+	int		i = 0;
+
+	if (pixel_dither!=TRUE || vncc_si.pf_truecolor==0)
+	{
+		for (i=n-1;i>=0;i--)
+			out[i] = vncc_lut[0][in[i]];
+		return;
+	}
+	l0 = vncc_lut[((y&1)<<1) | (x&1)];							// table for even and odd pixels
+	l1 = vncc_lut[((y&1)<<1) | ((x+1)&1)];
+	for (i=n-1;i>=0;i--)
+	{
+		if ((i&1)==0)
+			out[i] = l0[in[i]];
+		else	out[i] = l1[in[i]];
+	}
+}
+
+
+
+// n 32 bit pixels at the start of buf to big endian RGB565 in place, two at a time. buf must be word aligned
+static void pixel_line32(uint16_t *buf, int n)
+{
+	const uint32_t	*in  = (const uint32_t*)buf;
+	uint32_t	*out = (uint32_t*)buf;						// each output word is behind the input read
+	uint32_t	v0, v1, c0, c1;
+	int		i = 0;
+
+	if (vncc_pf32.scale==0 && vncc_si.pf_bigendian==0 && vncc_pf32.rshift==19 &&
+	    vncc_pf32.gshift==10 && vncc_pf32.bshift==3)					// xRGB8888, the usual one
+	{
+		for (i=0;i+1<n;i=i+2)
+		{
+			v0 = in[i];
+			v1 = in[i+1];
+			c0 = ((v0 >> 8) & 0xF800) | ((v0 >> 5) & 0x07E0) | ((v0 >> 3) & 0x001F);
+			c1 = ((v1 >> 8) & 0xF800) | ((v1 >> 5) & 0x07E0) | ((v1 >> 3) & 0x001F);
+			*out++ = (c0 >> 8) | ((c0 & 0xFF) << 8) | ((c1 & 0xFF00) << 8) | (c1 << 24);
+		}
+	}
+	else
+	{
+		for (i=0;i+1<n;i=i+2)
+		{
+			c0 = vncc_pixel32((vncc_si.pf_bigendian!=0) ? __builtin_bswap32(in[i])   : in[i]);
+			c1 = vncc_pixel32((vncc_si.pf_bigendian!=0) ? __builtin_bswap32(in[i+1]) : in[i+1]);
+			*out++ = (c0 >> 8) | ((c0 & 0xFF) << 8) | ((c1 & 0xFF00) << 8) | (c1 << 24);
+		}
+	}
+	if (i<n)										// odd pixel at the end
+	{
+		c0 = vncc_pixel((const uint8_t*)&in[i]);
+		buf[i] = (c0 >> 8) | (c0 << 8);
+	}
+}
+
+
+
+// Convert and queue h lines of w wire pixels packed one after the other, big endian RGB565 is
+// queued as it came.  buf is from jag_flush_get() and belongs to the flush task afterwards
+void vncc_pixel_draw_lines(uint16_t *buf, int w, int h, int x, int y)
+{
+	int64_t		st = 0;
+	int		l  = 0;
+
+	if (vncc_bpp==2 && vncc_si.pf_bigendian!=0)
+	{
+		jag_flush_put(x, y, w, h, buf, TRUE);
+		return;
+	}
+	st = esp_timer_get_time();
+	if (vncc_bpp==4)
+		pixel_line32(buf, w*h);
+	else if (vncc_bpp==1)
+	{
+		for (l=h-1;l>=0;l--)								// last line first, the others are still bytes
+			pixel_expand((const uint8_t*)buf+(l*w), buf+(l*w), w, x, y+l);
+	}
+	if (vncc_bpp!=2)
+	{
+		vncc_stats.convert_pixels += w*h;
+		vncc_stats.convert_us += esp_timer_get_time() - st;
+	}
+	jag_flush_put(x, y, w, h, buf, vncc_bpp==4);
+}
@@ -0,0 +1,131 @@
+/*
+ * vncc_rre.c
+ * RRE (2) and CoRRE (4) encodings for the VNC client (vncc)
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+/*
+	RRE is a background colour followed by a list of solid sub-rectangles, CoRRE is the same
+	with 8 bit sub-rectangle positions (the server keeps each rectangle under 256x256).
+
+	Small rectangles (text, icons) are built up in a flush buffer (jag_flush_get) and queued
+	as one transfer, otherwise every tiny sub-rectangle would cost an LCD window setup.  Larger
+	rectangles are queued as fills (jag_flush_fill), one window per sub-rectangle.  Either way
+	the flush task draws while the rest is read.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include "screen_driver.h"
+#include "lcd_vncc.h"
+#include "jag.h"
+#include "vncc_rx.h"
+#include "vncc_decode.h"
+
+extern const char	*TAG;
+
+
+
+// Fill part of the RAM copy of the rectangle, w is the width of the whole rectangle
+static void rre_buf_fill(uint16_t *buf, int w, int sx, int sy, int sw, int sh, uint16_t color)
+{
+	uint16_t	*p = NULL;
+	int		x  = 0;
+	int		y  = 0;
+
+	for (y=sy;y<sy+sh;y++)
+	{
+		p = buf + (y*w) + sx;
+		for (x=0;x<sw;x++)
+			*p++ = color;
+	}
+}
+
+
+
+// compact is TRUE for CoRRE
+int vncc_decode_rre(struct vnc_rect *rec, int compact)
+{
+	uint8_t		*p  = NULL;
+	uint32_t	ns  = 0;								// number of subrectangles
+	uint32_t	i   = 0;
+	uint16_t	bg  = 0;
+	uint16_t	fg  = 0;
+	int		sx, sy, sw, sh;
+	int		srlen = 0;								// bytes per subrectangle
+	uint16_t	*buf  = NULL;								// rectangle composed in RAM, NULL if too big
+
+	p = vncc_rx_need(4+vncc_bpp);								// subrectangle count and background
+	if (p==NULL)
+		return(-1);
+	ns = vncc_be32(p);
+	bg = vncc_pixel(p+4);
+	vncc_rx_consume(4+vncc_bpp);
+
+	if (rec->width*rec->height <= JAG_FLUSH_PIXELS)
+	{
+		buf = jag_flush_get();
+		rre_buf_fill(buf, rec->width, 0, 0, rec->width, rec->height, bg);
+	}
+	else	jag_flush_fill(rec->xpos, rec->ypos, rec->width, rec->height, bg);
+
+	if (compact==TRUE)
+		srlen = vncc_bpp + 4;
+	else	srlen = vncc_bpp + 8;
+	for (i=0;i<ns;i++)
+	{
+		p = vncc_rx_need(srlen);
+		if (p==NULL)
+			goto fail;
+		fg = vncc_pixel(p);
+		p = p + vncc_bpp;
+		if (compact==TRUE)
+		{
+			sx = p[0];
+			sy = p[1];
+			sw = p[2];
+			sh = p[3];
+		}
+		else
+		{
+			sx = vncc_be16(p);
+			sy = vncc_be16(p+2);
+			sw = vncc_be16(p+4);
+			sh = vncc_be16(p+6);
+		}
+		vncc_rx_consume(srlen);
+		if (sx+sw > rec->width || sy+sh > rec->height)
+		{
+			ESP_LOGE(TAG,"vncc_decode_rre() subrect %d,%d %dx%d outside %dx%d", sx, sy, sw, sh, rec->width, rec->height);
+			goto fail;
+		}
+		if (buf!=NULL)
+			rre_buf_fill(buf, rec->width, sx, sy, sw, sh, fg);
+		else	jag_flush_fill(rec->xpos+sx, rec->ypos+sy, sw, sh, fg);
+	}
+
+	if (buf!=NULL)
+		jag_flush_put(rec->xpos, rec->ypos, rec->width, rec->height, buf, FALSE);
+	return(0);
+
+fail:
+	if (buf!=NULL)
+		jag_flush_cancel(buf);
+	return(-1);
+}
@@ -0,0 +1,372 @@
+/*
+ * vncc_rx.c
+ * Buffered socket reader and writer for the VNC client (vncc)
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+/*
+	All reads from the VNC server come through here.  recv() is asked for as much as
+	will fit in the buffer, so one call usually empties the lwIP receive window rather
+	than returning a few hundred bytes at a time.  When the buffer runs dry we block in
+	select() until the socket is readable, no fixed sleeps.
+
+	The socket is non-blocking and vnc_task is the only task that uses it.  Each time a read
+	has to wait, vncc_service() (lcd_vncc.c) sends any update request that is due, reads the
+	touch panel and prints the counters, and select() sleeps only until the next of those.
+	Anything sent goes through vncc_tx_send(), what the socket will not take at once is kept
+	and sent when select() says there is room.
+
+	Unread bytes always sit at rx_buf[rx_rd] to rx_buf[rx_wr-1]. When a caller needs more
+	contiguous bytes than are left before the end of the buffer the unread tail is moved
+	back to the start, this is at most one partial message so is cheap.  Callers can then
+	decode straight from the buffer with vncc_rx_need() / vncc_rx_consume() or have it
+	copied out with vncc_rx_read().  A read of VNCC_RX_DIRECT bytes or more (RAW pixels going into
+	a flush buffer) takes what is buffered and then has recv() copy the rest straight into the
+	callers buffer, so lwIP's copy out of its pbufs is the only one before the SPI DMA.  lwIP
+	sockets cannot hand out the pbufs themselves, and lines of pixels split across TCP segments
+	would need joining before DMA anyway.
+
+	Nothing above this file knows about the socket.  vncc_rx_replay() takes the bytes from a
+	function instead, a recorded server stream, and drops whatever the client sends back.  The
+	same protocol code and decoders then run without the network (vncc_replay() in lcd_vncc.c).
+	It is still a pull: a decoder that runs out of buffered bytes mid rectangle calls the
+	function for more from inside vncc_rx_need(), as it would wait on the socket.  The parser
+	is not a push parser that returns between chunks, and it only runs on the ESP32.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+
+#include "lcd_vncc.h"
+#include "vncc_rx.h"
+#include "vncc_stats.h"
+
+extern const char	*TAG;
+
+static uint8_t		rx_buf[VNCC_RX_BUFSIZE];
+static int		rx_fd			= -1;
+static int		rx_rd			= 0;						// offset of first unread byte
+static int		rx_wr			= 0;						// offset one past last unread byte
+static uint32_t		rx_consumed		= 0;						// bytes handed to callers this connection
+static int		(*rx_source)(uint8_t *buf, int max) = NULL;			// replay, NULL reads the socket
+static uint8_t		tx_buf[VNCC_TX_BUFSIZE];
+static int		tx_len			= 0;						// bytes queued for the server
+
+
+
+// Start again with an empty buffer, called for each new connection and on hangup
+void vncc_rx_reset(int fd)
+{
+	rx_fd = fd;
+	rx_source = NULL;
+	rx_rd = 0;
+	rx_wr = 0;
+	rx_consumed = 0;
+	tx_len = 0;
+}
+
+
+
+// Read from source instead of a socket until the next vncc_rx_reset().  source puts up to max bytes
+// at buf and returns how many, 0 at the end of the recording
+void vncc_rx_replay(int (*source)(uint8_t *buf, int max))
+{
+	vncc_rx_reset(-1);
+	rx_source = source;
+}
+
+
+
+// Send what is queued without blocking, returns FALSE on socket error
+static int vncc_tx_flush()
+{
+	int len=0;
+
+	while (tx_len>0)
+	{
+		len = send(rx_fd, &tx_buf[0], tx_len, MSG_DONTWAIT);
+		if (len<0 && (errno==EAGAIN || errno==EWOULDBLOCK))				// socket full, rest goes later
+			return(TRUE);
+		if (len<=0)
+		{
+			ESP_LOGE(TAG,"vncc_tx_flush() send returned %d errno %d", len, errno);
+			return(FALSE);
+		}
+		memmove(&tx_buf[0], &tx_buf[len], tx_len-len);
+		tx_len = tx_len - len;
+	}
+	return(TRUE);
+}
+
+
+
+// Queue n bytes for the server and send as many as the socket takes now.  Only waits if the
+// queue is full.  Returns n, or -1 on error and the caller shuts the connection down
+int vncc_tx_send(const void *buf, int n)
+{
+	fd_set		wfds;
+	struct timeval	tv;
+
+	if (rx_source!=NULL)									// replies to a replay go nowhere
+		return(n);
+	if (rx_fd<0 || n > sizeof(tx_buf))
+		return(-1);
+	while (tx_len+n > sizeof(tx_buf))
+	{
+		if (vncc_tx_flush()!=TRUE)
+			return(-1);
+		if (tx_len+n <= sizeof(tx_buf))
+			break;
+		FD_ZERO(&wfds);
+		FD_SET(rx_fd, &wfds);
+		tv.tv_sec  = VNCC_RX_POLL_MS / 1000;
+		tv.tv_usec = (VNCC_RX_POLL_MS % 1000) * 1000;
+		if (select(rx_fd+1, NULL, &wfds, NULL, &tv) < 0)
+			return(-1);
+	}
+	memcpy(&tx_buf[tx_len], buf, n);
+	tx_len = tx_len + n;
+	if (vncc_tx_flush()!=TRUE)
+		return(-1);
+	return(n);
+}
+
+
+
+// Block until the socket has something for us, doing the other work of the client meanwhile.
+// Returns FALSE if the socket went away
+static int vncc_rx_wait()
+{
+	fd_set		rfds;
+	fd_set		wfds;
+	struct timeval	tv;
+	int64_t		st;
+	int		ms=0;
+	int		r=0;
+
+	vncc_stats.rx_waits++;
+	st = esp_timer_get_time();
+	do
+	{
+		ms = vncc_service();								// requests, touch, counters
+		if (rx_fd<0)									// shutdown meanwhile
+			return(FALSE);
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_SET(rx_fd, &rfds);
+		if (tx_len>0)									// something still to send
+			FD_SET(rx_fd, &wfds);
+		tv.tv_sec  = ms / 1000;
+		tv.tv_usec = (ms % 1000) * 1000;
+		r = select(rx_fd+1, &rfds, &wfds, NULL, &tv);
+		if (r>0 && FD_ISSET(rx_fd, &wfds) && vncc_tx_flush()!=TRUE)
+			return(FALSE);
+	} while (r>=0 && !FD_ISSET(rx_fd, &rfds));						// timed out or only writable
+	vncc_stats.rx_wait_us += esp_timer_get_time() - st;
+	return(r>0);
+}
+
+
+
+// Up to max bytes from the socket (or replay) into buf, waiting if there are none yet.
+// Returns how many, or -1 once the connection is shut down
+static int vncc_rx_recv(uint8_t *buf, int max)
+{
+	int len=0;
+
+	do
+	{
+		if (rx_source!=NULL)
+			len = rx_source(buf, max);						// replay, nothing to wait for
+		else
+		{
+			if (vncc_rx_wait()!=TRUE)
+			{
+				vncc_shutdown();
+				return(-1);
+			}
+			len = recv(rx_fd, buf, max, 0);						// take as much as the socket has
+			if (len<0 && (errno==EAGAIN || errno==EWOULDBLOCK))			// nothing after all
+				continue;
+		}
+		if (len<=0)									// error, server hung up or end of replay
+		{
+			if (rx_source==NULL)
+				ESP_LOGE(TAG,"vncc_rx_recv() recv returned %d errno %d", len, errno);
+			vncc_shutdown();
+			return(-1);
+		}
+	} while (len<=0);
+	vncc_stats.rx_recv_calls++;
+	vncc_stats.rx_bytes += len;
+	if (len > vncc_stats.rx_recv_max)
+		vncc_stats.rx_recv_max = len;
+	return(len);
+}
+
+
+
+// Make sure at least n unread bytes are in the buffer, returns FALSE on socket error or hangup
+static int vncc_rx_fill(int n)
+{
+	int len=0;
+
+	if (rx_wr-rx_rd >= n)
+		return(TRUE);
+	if (rx_rd+n > sizeof(rx_buf))								// would run off the end ?
+	{
+		memmove(&rx_buf[0], &rx_buf[rx_rd], rx_wr-rx_rd);				// then move unread bytes to the start
+		rx_wr = rx_wr-rx_rd;
+		rx_rd = 0;
+	}
+	while (rx_wr-rx_rd < n)
+	{
+		if ((len = vncc_rx_recv(&rx_buf[rx_wr], sizeof(rx_buf)-rx_wr)) < 0)
+			return(FALSE);
+		rx_wr = rx_wr + len;
+	}
+	return(TRUE);
+}
+
+
+
+// Returns a pointer to the next n bytes without consuming them, NULL on error.  n must not exceed VNCC_RX_BUFSIZE
+uint8_t* vncc_rx_need(int n)
+{
+	if (n > sizeof(rx_buf))
+	{
+		ESP_LOGE(TAG,"vncc_rx_need() %d bytes is larger than buffer", n);
+		return(NULL);
+	}
+	if (vncc_rx_fill(n)!=TRUE)
+		return(NULL);
+	return(&rx_buf[rx_rd]);
+}
+
+
+
+// Mark n bytes previously returned by vncc_rx_need() as used
+void vncc_rx_consume(int n)
+{
+	rx_consumed = rx_consumed + n;
+	rx_rd = rx_rd + n;
+	if (rx_rd >= rx_wr)									// buffer empty, start at the beginning again
+	{
+		rx_rd = 0;
+		rx_wr = 0;
+	}
+}
+
+
+
+// Copy n bytes into buf, any size. Returns n or -1 on error
+int vncc_rx_read(void *buf, int n)
+{
+	int	c=0;
+	int	done=0;
+
+	if (n >= VNCC_RX_DIRECT)								// a big block, RAW pixels into a flush buffer
+	{
+		done = rx_wr-rx_rd;								// what is buffered first
+		if (done > n)
+			done = n;
+		memcpy(buf, &rx_buf[rx_rd], done);
+		vncc_rx_consume(done);
+		while (n-done >= VNCC_RX_DIRECT)						// then lwIP copies the rest straight in
+		{
+			if ((c = vncc_rx_recv((uint8_t*)buf+done, n-done)) < 0)
+				return(-1);
+			rx_consumed = rx_consumed + c;
+			vncc_stats.rx_direct += c;
+			done = done + c;
+		}
+	}
+	while (done<n)
+	{
+		c = n-done;
+		if (c > sizeof(rx_buf))
+			c = sizeof(rx_buf);
+		if (vncc_rx_fill(c)!=TRUE)
+			return(-1);
+		memcpy((uint8_t*)buf+done, &rx_buf[rx_rd], c);
+		vncc_rx_consume(c);
+		done = done + c;
+	}
+	return(n);
+}
+
+
+
+// Throw away n bytes, returns n or -1 on error
+int vncc_rx_skip(int n)
+{
+	int	c=0;
+	int	done=0;
+
+	while (done<n)
+	{
+		c = n-done;
+		if (c > sizeof(rx_buf))
+			c = sizeof(rx_buf);
+		if (vncc_rx_fill(c)!=TRUE)
+			return(-1);
+		vncc_rx_consume(c);
+		done = done + c;
+	}
+	return(n);
+}
+
+
+
+int vncc_rx_available()
+{
+	return(rx_wr-rx_rd);
+}
+
+
+
+// Bytes read so far on this connection, the difference between two calls is what a message cost on the wire
+uint32_t vncc_rx_position()
+{
+	return(rx_consumed);
+}
+
+
+
+// Discard everything buffered plus anything the socket has ready now, returns bytes thrown away
+int vncc_rx_drain()
+{
+	int	len=0;
+	int	total=0;
+
+	total = rx_wr-rx_rd;
+	rx_rd = 0;
+	rx_wr = 0;
+	if (rx_fd<0)
+		return(total);
+	do
+	{
+		len = recv(rx_fd, &rx_buf[0], sizeof(rx_buf), MSG_DONTWAIT);
+		if (len>0)
+			total = total + len;
+	} while (len>0);
+	return(total);
+}
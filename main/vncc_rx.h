@@ -0,0 +1,35 @@
+/*
+ * vncc_rx.h
+ * Buffered socket reader for the VNC client (vncc)
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+#define VNCC_RX_BUFSIZE				8192					// larger than the lwIP TCP window so one recv() can empty it
+#define VNCC_RX_POLL_MS				1000					// how often a blocked read checks the socket is still ours
+#define VNCC_RX_DIRECT				1024					// reads this big go from lwIP to the caller, not via the buffer
+#define VNCC_TX_BUFSIZE				512					// sends the socket has not yet taken
+
+
+// Prototypes
+void	 vncc_rx_reset(int fd);
+void	 vncc_rx_replay(int (*source)(uint8_t *buf, int max));
+uint8_t* vncc_rx_need(int n);
+void	 vncc_rx_consume(int n);
+int	 vncc_rx_read(void *buf, int n);
+int	 vncc_rx_skip(int n);
+int	 vncc_rx_available();
+uint32_t vncc_rx_position();
+int	 vncc_rx_drain();
+int	 vncc_tx_send(const void *buf, int n);
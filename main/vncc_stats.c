@@ -0,0 +1,265 @@
+/*
+ * vncc_stats.c
+ * Performance counters for the VNC client (vncc)
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_freertos_hooks.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp32/rom/miniz.h"
+
+#include "screen_driver.h"
+#include "jag.h"
+#include "lcd_vncc.h"
+#include "vncc_stats.h"
+#include "vncc_inflate.h"
+#include "vncc_decode.h"
+#include "vncc_pace.h"
+
+extern const char	*TAG;
+
+struct vncc_stats	vncc_stats;
+
+// Per core load, sampled each tick by looking at which task was interrupted.  Counts from boot
+static TaskHandle_t	load_idle[portNUM_PROCESSORS];
+static volatile uint32_t	load_ticks[portNUM_PROCESSORS];
+static volatile uint32_t	load_busy[portNUM_PROCESSORS];					// ticks that did not land in the idle task
+static uint32_t		load_ticks_last[portNUM_PROCESSORS];
+static uint32_t		load_busy_last[portNUM_PROCESSORS];
+
+
+
+// Tick interrupt, on each core
+static void IRAM_ATTR vncc_stats_tick()
+{
+	int	c = xPortGetCoreID();
+
+	load_ticks[c]++;
+	if (xTaskGetCurrentTaskHandleForCPU(c)!=load_idle[c])
+		load_busy[c]++;
+}
+
+
+
+// Start counting how busy each core is, the "cores" line of vncc_stats_print()
+void vncc_stats_load_init()
+{
+	int	c = 0;
+
+	for (c=0;c<portNUM_PROCESSORS;c++)
+	{
+		load_idle[c] = xTaskGetIdleTaskHandleForCPU(c);
+		esp_register_freertos_tick_hook_for_cpu(vncc_stats_tick, c);
+	}
+}
+
+
+
+void vncc_stats_reset()
+{
+	bzero(&vncc_stats, sizeof(vncc_stats));
+	vncc_stats.start_us = esp_timer_get_time();
+	vncc_stats.lcd_pixels_start = jag_get_pixels();						// jag counts from boot
+	vncc_stats.lcd_wire_start = jag_get_wire_pixels();
+	vncc_stats.lcd_windows_start = jag_get_windows();
+	vncc_stats.lcd_shadow_start = jag_get_shadow_pixels();
+	vncc_stats.lcd_cycles_start = jag_get_busy_cycles();
+	vncc_stats.lcd_busy_start = jag_get_busy_us();
+	vncc_stats.lcd_stall_start = jag_get_stall_us();
+}
+
+
+
+// Account for one decoded rectangle, us is the total of which wait_us was network and lcd_us waiting for the LCD
+void vncc_stats_rect(int32_t encoding_type, uint32_t pixels, uint32_t bytes, uint32_t us, uint32_t wait_us, uint32_t lcd_us)
+{
+	struct vncc_enc_stats	*es = NULL;
+	int			i = 0;
+
+	for (i=0;i<VNCC_STATS_MAX_ENCODINGS;i++)
+	{
+		es = &vncc_stats.enc[i];
+		if (es->rects==0)								// unused slot, claim it
+			es->encoding_type = encoding_type;
+		if (es->encoding_type == encoding_type)
+			break;
+	}
+	if (i==VNCC_STATS_MAX_ENCODINGS)							// table full, not counted
+		return;
+	es->rects++;
+	es->pixels += pixels;
+	es->bytes  += bytes;
+	es->us     += us;
+	es->wait_us+= wait_us;
+	es->lcd_us += lcd_us;
+}
+
+
+
+// Account for one complete FramebufferUpdate
+void vncc_stats_update(uint32_t bytes, uint32_t us, uint32_t cpu_us)
+{
+	vncc_stats.updates++;
+	vncc_stats.update_bytes += bytes;
+	vncc_stats.update_us    += us;
+	vncc_stats.update_cpu_us += cpu_us;
+	if (us > vncc_stats.update_max_us)
+		vncc_stats.update_max_us = us;
+}
+
+
+
+static void vncc_stats_print_tiles(char *name, struct vncc_tile_stats *ts)
+{
+	if (ts->tiles==0)
+		return;
+	ESP_LOGI(TAG,"%s: %u raw %u solid %u palette %u rle tiles, decode avg %uus max %uus per tile",
+		name, ts->raw, ts->solid, ts->palette, ts->rle,
+		(uint32_t)(ts->us / ts->tiles), ts->max_us);
+}
+
+
+
+void vncc_stats_print()
+{
+	struct vncc_enc_stats	*es = NULL;
+	uint32_t		avg = 0;
+	uint32_t		ups = 0;							// updates per 10 seconds
+	uint64_t		up  = 0;
+	uint64_t		px  = 0;
+	uint64_t		sh  = 0;
+	uint64_t		busy  = 0;
+	uint64_t		stall = 0;
+	uint32_t		t = 0;
+	uint32_t		b = 0;
+	char			load[16*portNUM_PROCESSORS] = "";
+	int			i = 0;
+
+	if (vncc_stats.rx_recv_calls > 0)
+		avg = vncc_stats.rx_bytes / vncc_stats.rx_recv_calls;
+	ESP_LOGI(TAG,"rx: %u bytes in %u recv() avg %u max %u, %u straight to the decoder, waited %u times for %ums",
+		vncc_stats.rx_bytes, vncc_stats.rx_recv_calls, avg, vncc_stats.rx_recv_max, vncc_stats.rx_direct,
+		vncc_stats.rx_waits, (uint32_t)(vncc_stats.rx_wait_us / 1000));
+
+	up = esp_timer_get_time() - vncc_stats.start_us;
+	if (up > 0)
+		ups = (uint32_t)(((uint64_t)vncc_stats.updates * 10000000) / up);
+	if (vncc_stats.updates > 0)
+		ESP_LOGI(TAG,"updates: %u, %u.%u/s avg %u bytes %uus, max %uus, %ums CPU per MB", vncc_stats.updates, ups/10, ups%10,
+			vncc_stats.update_bytes / vncc_stats.updates,
+			(uint32_t)(vncc_stats.update_us / vncc_stats.updates), vncc_stats.update_max_us,
+			(vncc_stats.update_bytes > 0) ? (uint32_t)((vncc_stats.update_cpu_us * 1024 * 1024 / 1000) / vncc_stats.update_bytes) : 0);
+
+	if (vncc_stats.hextile_raw_tiles+vncc_stats.hextile_solid_tiles+vncc_stats.hextile_subrect_tiles > 0)
+		ESP_LOGI(TAG,"hextile: %u raw %u solid %u subrect tiles, %u subrects",
+			vncc_stats.hextile_raw_tiles, vncc_stats.hextile_solid_tiles,
+			vncc_stats.hextile_subrect_tiles, vncc_stats.hextile_subrects);
+
+	if (vncc_stats.inflate_in > 0 && vncc_stats.inflate_us > 0)
+		ESP_LOGI(TAG,"inflate: %u bytes in %u bytes out in %ums, %u KB/s out",
+			(uint32_t)vncc_stats.inflate_in, (uint32_t)vncc_stats.inflate_out,
+			(uint32_t)(vncc_stats.inflate_us / 1000),
+			(uint32_t)((vncc_stats.inflate_out * 1000000 / vncc_stats.inflate_us) / 1024));
+
+	if (vncc_stats.tight_jpeg > 0)
+		ESP_LOGI(TAG,"jpeg: %u rects avg %u bytes, decode avg %uus",
+			vncc_stats.tight_jpeg, vncc_stats.tight_jpeg_bytes / vncc_stats.tight_jpeg,
+			(uint32_t)(vncc_stats.tight_jpeg_us / vncc_stats.tight_jpeg));
+
+	if (vncc_stats.tight_fill+vncc_stats.tight_copy+vncc_stats.tight_palette+vncc_stats.tight_gradient > 0)
+		ESP_LOGI(TAG,"tight: %u fill %u copy %u palette %u gradient rects, %u not compressed, %u stream resets",
+			vncc_stats.tight_fill, vncc_stats.tight_copy, vncc_stats.tight_palette,
+			vncc_stats.tight_gradient, vncc_stats.tight_uncompressed, vncc_stats.tight_resets);
+
+	vncc_stats_print_tiles("trle", &vncc_stats.trle);
+	vncc_stats_print_tiles("zrle", &vncc_stats.zrle);
+
+	ESP_LOGI(TAG,"flow: %s, %u update requests sent, %u while drawing the update before, %u fences answered",
+		vncc_stats.cu_enabled ? "continuous updates" : "polling", vncc_stats.requests, vncc_stats.pipelined,
+		vncc_stats.fences);
+	if (vncc_stats.cu_enabled==0 && vncc_stats.requests > 0)
+		ESP_LOGI(TAG,"pace: rtt %u.%ums decode %u.%ums flush %u.%ums, next request %u.%ums after an update (%d to %d Hz)",
+			vncc_stats.pace_rtt_us/1000, (vncc_stats.pace_rtt_us/100)%10,
+			vncc_stats.pace_decode_us/1000, (vncc_stats.pace_decode_us/100)%10,
+			vncc_stats.pace_flush_us/1000, (vncc_stats.pace_flush_us/100)%10,
+			vncc_stats.pace_delay_us/1000, (vncc_stats.pace_delay_us/100)%10,
+			VNCC_PACE_FLOOR_HZ, VNCC_PACE_CEILING_HZ);
+
+	if (vncc_stats.cursor_draws > 0)
+		ESP_LOGI(TAG,"cursor: drawn %u times", vncc_stats.cursor_draws);
+
+	if (vncc_stats.convert_pixels > 0 && vncc_stats.convert_us > 0)
+		ESP_LOGI(TAG,"convert: %u pixels from %d bit in %ums, %u pixels/s",
+			(uint32_t)vncc_stats.convert_pixels, vncc_si.pf_bpp, (uint32_t)(vncc_stats.convert_us / 1000),
+			(uint32_t)((vncc_stats.convert_pixels * 1000000) / vncc_stats.convert_us));
+
+	px = jag_get_pixels() - vncc_stats.lcd_pixels_start;
+	if (px > 0)
+		ESP_LOGI(TAG,"lcd: %u pixels drawn in %u windows, %u%% sent as received, %u cycles per %dx%d frame",
+			(uint32_t)px, (uint32_t)(jag_get_windows() - vncc_stats.lcd_windows_start),
+			(uint32_t)(((jag_get_wire_pixels() - vncc_stats.lcd_wire_start) * 100) / px),
+			(uint32_t)(((jag_get_busy_cycles() - vncc_stats.lcd_cycles_start) *
+				    jag_get_display_width() * jag_get_display_height()) / px),
+			jag_get_display_width(), jag_get_display_height());
+
+	sh = jag_get_shadow_pixels() - vncc_stats.lcd_shadow_start;
+	if (sh > 0)											// tiles resent unchanged are not sent to the panel
+		ESP_LOGI(TAG,"shadow: %u pixels drawn into the shadow, %u sent to the panel",
+			(uint32_t)sh, (uint32_t)px);
+
+	busy  = jag_get_busy_us() - vncc_stats.lcd_busy_start;
+	stall = jag_get_stall_us() - vncc_stats.lcd_stall_start;
+	if (stall > busy)										// waits for a wait marker can run longer
+		stall = busy;
+	if (busy > 0)											// the rest overlapped with network and decode
+		ESP_LOGI(TAG,"flush: LCD busy %ums, held up for %ums, %u%% overlapped",
+			(uint32_t)(busy / 1000), (uint32_t)(stall / 1000), (uint32_t)(((busy - stall) * 100) / busy));
+
+	for (i=0;i<portNUM_PROCESSORS;i++)							// since the last print, not since connecting
+	{
+		t = load_ticks[i] - load_ticks_last[i];
+		b = load_busy[i] - load_busy_last[i];
+		load_ticks_last[i] += t;
+		load_busy_last[i] += b;
+		if (t > 0)
+			snprintf(load+strlen(load), sizeof(load)-strlen(load), " %d:%u%%", i, (b*100)/t);
+	}
+	if (load[0]!=0)
+		ESP_LOGI(TAG,"cores: busy%s (vnc_task on %d, lcd_flush on %d)", load, VNCC_CORE, JAG_FLUSH_CORE);
+
+	vncc_stats.vnc_stack_free = uxTaskGetStackHighWaterMark(NULL);				// vnc_task, lowest since it started so every decoder counts
+	ESP_LOGI(TAG,"ram: heap free %u lowest %u, zlib %u, vnc_task stack unused %u",
+		esp_get_free_heap_size(), esp_get_minimum_free_heap_size(), vncc_inflate_ram(),
+		vncc_stats.vnc_stack_free);
+
+	// decode is whatever is left once network waits and LCD transfers are taken out
+	for (i=0;i<VNCC_STATS_MAX_ENCODINGS;i++)
+	{
+		es = &vncc_stats.enc[i];
+		if (es->rects==0)
+			break;
+		ESP_LOGI(TAG,"et=%d: %u rects %u pixels %u bytes, avg %u bytes %uus per rect, total net %ums lcd %ums decode %ums",
+			es->encoding_type, es->rects, es->pixels, es->bytes,
+			es->bytes / es->rects, (uint32_t)(es->us / es->rects),
+			(uint32_t)(es->wait_us / 1000), (uint32_t)(es->lcd_us / 1000),
+			(uint32_t)((es->us - es->wait_us - es->lcd_us) / 1000));
+	}
+}
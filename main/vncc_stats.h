@@ -0,0 +1,137 @@
+/*
+ * vncc_stats.h
+ * Performance counters for the VNC client (vncc)
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+#define VNCC_STATS_INTERVAL_S			10					// print counters this often while connected
+#define VNCC_STATS_MAX_ENCODINGS		12					// distinct encoding types counted
+
+
+// Per encoding, lets one encoding be compared with another (RAW against CopyRect etc)
+struct vncc_enc_stats
+{
+	int32_t		encoding_type;
+	uint32_t	rects;
+	uint32_t	pixels;
+	uint32_t	bytes;									// bytes on the wire including the 12 byte rectangle header
+	uint64_t	us;									// time to read and draw
+	uint64_t	wait_us;								// part of us blocked on the network
+	uint64_t	lcd_us;									// part of us held up by the LCD
+};
+
+
+// Per tile based encoding (TRLE, ZRLE), tile times are decode only, network waits and LCD transfers excluded
+struct vncc_tile_stats
+{
+	uint32_t	raw;
+	uint32_t	solid;
+	uint32_t	palette;								// packed palette
+	uint32_t	rle;									// plain and palette RLE
+	uint32_t	tiles;
+	uint64_t	us;
+	uint32_t	max_us;
+};
+
+
+// Counters only ever go up, vncc_stats_reset() clears them when a new connection starts
+struct vncc_stats
+{
+	// Socket receive (vncc_rx.c)
+	uint32_t	rx_recv_calls;								// number of recv() calls that returned data
+	uint32_t	rx_bytes;								// total bytes returned by recv()
+	uint32_t	rx_recv_max;								// largest single recv()
+	uint32_t	rx_waits;								// times the buffer was empty and we blocked
+	uint64_t	rx_wait_us;								// time spent blocked waiting for the socket
+	uint32_t	rx_direct;								// of rx_bytes, received straight into the callers buffer
+
+	// FramebufferUpdate messages, one scroll or window move is usually one update
+	uint64_t	start_us;								// when the counters were reset, for updates per second
+	uint32_t	updates;
+	uint32_t	update_bytes;
+	uint64_t	update_us;
+	uint64_t	update_cpu_us;								// of update_us, neither network nor LCD wait
+	uint32_t	update_max_us;
+
+	// Hextile (vncc_hextile.c)
+	uint32_t	hextile_raw_tiles;
+	uint32_t	hextile_solid_tiles;							// background only
+	uint32_t	hextile_subrect_tiles;
+	uint32_t	hextile_subrects;
+
+	// Zlib streams (vncc_inflate.c)
+	uint64_t	inflate_in;								// compressed bytes given to tinfl
+	uint64_t	inflate_out;								// bytes tinfl produced
+	uint64_t	inflate_us;								// time inside tinfl, for zlib throughput alone
+
+	// Tight (vncc_tight.c), rectangles by type
+	uint32_t	tight_fill;
+	uint32_t	tight_copy;
+	uint32_t	tight_palette;
+	uint32_t	tight_gradient;
+	uint32_t	tight_uncompressed;							// under 12 bytes so sent without zlib
+	uint32_t	tight_resets;								// zlib stream resets asked for by the server
+	uint32_t	tight_jpeg;
+	uint32_t	tight_jpeg_bytes;
+	uint64_t	tight_jpeg_us;								// TJpgDec only, network waits and LCD transfers excluded
+
+	// Tile based encodings (vncc_tile.c)
+	struct vncc_tile_stats	trle;
+	struct vncc_tile_stats	zrle;
+
+	// ContinuousUpdates and Fence (lcd_vncc.c)
+	uint32_t	cu_enabled;								// server is pushing updates, no polling
+	uint32_t	fences;									// ServerFences answered
+	uint32_t	requests;								// FramebufferUpdateRequests sent
+	uint32_t	pipelined;								// of which sent while an update was being drawn
+
+	// Request pacing, smoothed (vncc_pace.c)
+	uint32_t	pace_rtt_us;								// request sent to update header read
+	uint32_t	pace_decode_us;								// CPU time per update
+	uint32_t	pace_flush_us;								// SPI time per update
+	uint32_t	pace_delay_us;								// next request this long after an update header
+
+	// RAW and Zlib lines converted from 8 or 32 bit pixels (vncc_pixel.c)
+	uint64_t	convert_pixels;
+	uint64_t	convert_us;
+
+	// LCD (jag.c), values at reset as jag counts from boot
+	uint64_t	lcd_pixels_start;
+	uint64_t	lcd_wire_start;								// drawn as they came off the network
+	uint64_t	lcd_windows_start;							// window setups
+	uint64_t	lcd_shadow_start;							// pixels drawn into the shadow framebuffer
+	uint64_t	lcd_cycles_start;							// CPU cycles inside jag
+	uint64_t	lcd_busy_start;								// microseconds of LCD transfers
+	uint64_t	lcd_stall_start;							// microseconds vnc_task waited for the LCD
+
+	// Locally drawn pointer (vncc_cursor.c)
+	uint32_t	cursor_draws;
+
+	// RAM
+	uint32_t	vnc_stack_free;								// vnc_task stack never used, as of the last vncc_stats_print()
+
+	struct vncc_enc_stats	enc[VNCC_STATS_MAX_ENCODINGS];
+};
+
+
+extern struct vncc_stats	vncc_stats;
+
+
+// Prototypes
+void vncc_stats_reset();
+void vncc_stats_print();
+void vncc_stats_load_init();
+void vncc_stats_rect(int32_t encoding_type, uint32_t pixels, uint32_t bytes, uint32_t us, uint32_t wait_us, uint32_t lcd_us);
+void vncc_stats_update(uint32_t bytes, uint32_t us, uint32_t cpu_us);
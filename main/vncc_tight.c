@@ -0,0 +1,537 @@
+/*
+ * vncc_tight.c
+ * Tight encoding (7) for the VNC client (vncc)
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+/*
+	Each rectangle starts with a compression control byte, the low 4 bits ask for zlib
+	streams 0-3 to be reset, the top 4 bits say what follows:
+		1000		fill, one TPIXEL
+		1001		JPEG, a 1-3 byte length then a JPEG image
+		0xyy		basic, zlib stream yy, x set if a filter id byte follows
+
+	Basic compression sends pixels through a filter, copy (plain TPIXELs), palette (2 to 256
+	TPIXELs then 1 bit or 8 bit indexes) or gradient (TPIXELs less a prediction from the pixels
+	left, above and above left).  Filtered data under 12 bytes is sent as it is, otherwise it
+	is a 1-3 byte length then zlib data on the chosen stream.
+
+	The four streams last the whole connection and cost about 43K each, so each is allocated
+	the first time the server uses it (vncc_inflate.c).  Pixels are decoded a line at a time
+	straight out of the stream into flush buffers (jag_flush_get) and queued for the LCD in
+	bands of up to JAG_FLUSH_PIXELS, the next band is decoded while one is sent.
+
+	JPEG is decoded by the TJpgDec in the ESP32 ROM, fed straight from the receive buffer,
+	each MCU (at most 16x16) it produces is converted to RGB565 and queued as it arrives so no
+	image buffer is needed.  The server only sends JPEG once a QualityLevel has been asked for.
+
+	A bad JPEG or basic rectangle hangs up, like ZRLE.  What follows depends on the zlib streams
+	and lengths that were lost, so there is nothing to drain back to.
+
+	A TPIXEL is the server pixel, except 32 bit 8-8-8 true colour which is sent as R,G,B.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp32/rom/miniz.h"
+#include "esp32/rom/tjpgd.h"
+
+#include "screen_driver.h"
+#include "lcd_vncc.h"
+#include "jag.h"
+#include "vncc_rx.h"
+#include "vncc_stats.h"
+#include "vncc_inflate.h"
+#include "vncc_tile.h"
+#include "vncc_decode.h"
+
+#define TIGHT_STREAMS			4
+#define TIGHT_MIN_TO_COMPRESS		12						// smaller data is never compressed
+#define TIGHT_MAXWIDTH			512						// wider than any panel we drive
+#define TIGHT_JPEG_POOL			3100						// TJpgDec work area
+#define TIGHT_JPEG_MCU			(16*16)						// largest block TJpgDec outputs
+
+// Compression control, top 4 bits
+#define TIGHT_FILL			0x08
+#define TIGHT_JPEG			0x09
+#define TIGHT_EXPLICIT_FILTER		0x04
+
+// Filter ids
+#define TIGHT_FILTER_COPY		0
+#define TIGHT_FILTER_PALETTE		1
+#define TIGHT_FILTER_GRADIENT		2
+
+extern const char	*TAG;
+
+static struct vncc_inflate	tz[TIGHT_STREAMS];						// the connections zlib streams
+static struct vncc_inflate	*cur_tz		= NULL;						// stream for this rectangle
+static struct vncc_tile_src	src;								// where this rectangles pixel data comes from
+static int			tpsize		= 2;						// bytes per TPIXEL
+
+static uint16_t			palette[256];
+static uint8_t			row[TIGHT_MAXWIDTH*3];						// one line of filtered data
+static uint8_t			grad[2][TIGHT_MAXWIDTH*3];					// gradient, this and the previous line as R,G,B
+
+static uint8_t			jpeg_pool[TIGHT_JPEG_POOL];
+static struct vnc_rect		*jpeg_rec	= NULL;
+static uint32_t			jpeg_left	= 0;						// JPEG bytes not yet given to TJpgDec
+static int			jpeg_rxerr	= FALSE;
+
+
+
+// Pixel data from the current zlib stream
+static uint8_t* tight_zneed(int n)
+{
+	return(vncc_inflate_need(cur_tz, n));
+}
+
+static void tight_zconsume(int n)
+{
+	vncc_inflate_consume(cur_tz, n);
+}
+
+static struct vncc_tile_src	tight_zsrc  = { tight_zneed, tight_zconsume };
+static struct vncc_tile_src	tight_rxsrc = { vncc_rx_need, vncc_rx_consume };
+
+
+
+// One TPIXEL to the RGB565 value jag draws
+static inline uint16_t tight_tpixel(const uint8_t *p)
+{
+	if (tpsize==vncc_bpp)
+		return(vncc_pixel(p));
+	return(((p[0]>>3)<<11) | ((p[1]>>2)<<5) | (p[2]>>3));
+}
+
+
+
+// Read n bytes of pixel data into buf, a chunk at a time as need() is limited to 256 bytes
+static int tight_read(uint8_t *buf, int n)
+{
+	uint8_t		*p = NULL;
+	int		c  = 0;
+
+	while (n>0)
+	{
+		c = n;
+		if (c > VNCC_INFLATE_MAXNEED)
+			c = VNCC_INFLATE_MAXNEED;
+		if ((p = src.need(c)) == NULL)
+			return(-1);
+		memcpy(buf, p, c);
+		src.consume(c);
+		buf = buf + c;
+		n = n - c;
+	}
+	return(0);
+}
+
+
+
+// Tight lengths are 7 bits per byte, low bits first, top bit set if another byte follows, the third byte uses all 8
+static int tight_compact_length()
+{
+	uint8_t		*p   = NULL;
+	int		len  = 0;
+	int		i    = 0;
+
+	for (i=0;i<3;i++)
+	{
+		if ((p = vncc_rx_need(1)) == NULL)
+			return(-1);
+		if (i==2)
+			len = len | (*p << 14);
+		else	len = len | ((*p & 0x7F) << (7*i));
+		vncc_rx_consume(1);
+		if ((*p & 0x80) == 0)
+			break;
+	}
+	return(len);
+}
+
+
+
+// A server pixel value put back together by the gradient filter to RGB565
+static inline uint16_t tight_value(uint32_t v)
+{
+	if (tpsize==1)
+		return(vncc_lut[0][v & 0xFF]);
+	if (tpsize==4)
+		return(vncc_pixel32(v));
+	return(v);
+}
+
+
+
+// Split a pixel into R,G,B for the gradient filter
+static inline void tight_rgb(const uint8_t *p, uint8_t *c)
+{
+	uint32_t	v = 0;
+
+	if (tpsize!=vncc_bpp)
+	{
+		c[0] = p[0];
+		c[1] = p[1];
+		c[2] = p[2];
+		return;
+	}
+	v = vncc_pixel_value(p);								// the server value, not RGB565
+	c[0] = (v >> vncc_si.pf_shiftred)   & vncc_si.pf_maxred;
+	c[1] = (v >> vncc_si.pf_shiftgreen) & vncc_si.pf_maxgreen;
+	c[2] = (v >> vncc_si.pf_shiftblue)  & vncc_si.pf_maxblue;
+}
+
+
+
+// Decode one line of w pixels from row[] into out[]
+static void tight_line(int filter, int w, int y, int ncolours, uint16_t *out)
+{
+	uint8_t		*p    = row;
+	uint8_t		*cur  = grad[y & 1];
+	uint8_t		*prev = grad[(y & 1) ^ 1];
+	uint16_t	max[3];
+	int		est, x, c;
+
+	switch (filter)
+	{
+		case TIGHT_FILTER_COPY:
+			for (x=0;x<w;x++)
+			{
+				*out++ = tight_tpixel(p);
+				p = p + tpsize;
+			}
+		break;
+
+		case TIGHT_FILTER_PALETTE:
+			if (ncolours==2)
+			{
+				for (x=0;x<w;x++)
+					*out++ = palette[(p[x>>3] >> (7-(x&7))) & 1];
+			}
+			else
+			{
+				for (x=0;x<w;x++)
+					*out++ = palette[*p++];
+			}
+		break;
+
+		case TIGHT_FILTER_GRADIENT:
+			max[0] = 255;
+			max[1] = 255;
+			max[2] = 255;
+			if (tpsize==vncc_bpp)
+			{
+				max[0] = vncc_si.pf_maxred;
+				max[1] = vncc_si.pf_maxgreen;
+				max[2] = vncc_si.pf_maxblue;
+			}
+			if (y==0)
+				bzero(prev, w*3);
+			for (x=0;x<w;x++)
+			{
+				tight_rgb(p, &cur[x*3]);						// the difference from the prediction
+				p = p + tpsize;
+				for (c=0;c<3;c++)
+				{
+					est = prev[(x*3)+c];
+					if (x>0)
+						est = est + cur[((x-1)*3)+c] - prev[((x-1)*3)+c];
+					if (est < 0)
+						est = 0;
+					if (est > max[c])
+						est = max[c];
+					cur[(x*3)+c] = (est + cur[(x*3)+c]) & max[c];
+				}
+				if (tpsize==vncc_bpp)
+					*out++ = tight_value(((uint32_t)cur[x*3] << vncc_si.pf_shiftred) |
+							     ((uint32_t)cur[(x*3)+1] << vncc_si.pf_shiftgreen) |
+							     ((uint32_t)cur[(x*3)+2] << vncc_si.pf_shiftblue));
+				else	*out++ = ((cur[x*3]>>3)<<11) | ((cur[(x*3)+1]>>2)<<5) | (cur[(x*3)+2]>>3);
+			}
+		break;
+	}
+}
+
+
+
+// TJpgDec wants more of the JPEG, buf is NULL if it wants to skip n bytes. Returns bytes given, 0 at the end
+static UINT tight_jpeg_in(JDEC *jd, BYTE *buf, UINT n)
+{
+	if (n > jpeg_left)
+		n = jpeg_left;
+	if (n==0)
+		return(0);
+	if (buf==NULL)
+	{
+		if (vncc_rx_skip(n) < 0)
+			jpeg_rxerr = TRUE;
+	}
+	else if (vncc_rx_read(buf, n) != n)
+		jpeg_rxerr = TRUE;
+	if (jpeg_rxerr==TRUE)
+		return(0);
+	jpeg_left = jpeg_left - n;
+	return(n);
+}
+
+
+
+// One decoded block of RGB888, clipped to the rectangle and queued
+static UINT tight_jpeg_out(JDEC *jd, void *bitmap, JRECT *r)
+{
+	uint8_t		*p = (uint8_t*)bitmap;
+	uint16_t	*mcu = NULL;
+	uint16_t	*o = NULL;
+	int		w  = r->right - r->left + 1;
+	int		cw = w;
+	int		ch = r->bottom - r->top + 1;
+	int		x, y;
+
+	if (r->left >= jpeg_rec->width || r->top >= jpeg_rec->height)
+		return(1);
+	if (r->left + cw > jpeg_rec->width)
+		cw = jpeg_rec->width - r->left;
+	if (r->top + ch > jpeg_rec->height)
+		ch = jpeg_rec->height - r->top;
+	if (cw*ch > TIGHT_JPEG_MCU)
+		return(0);
+	mcu = jag_flush_get();
+	o = mcu;
+	for (y=0;y<ch;y++)
+	{
+		p = (uint8_t*)bitmap + (y*w*3);
+		for (x=0;x<cw;x++)
+		{
+			*o++ = ((p[0]>>3)<<11) | ((p[1]>>2)<<5) | (p[2]>>3);
+			p = p + 3;
+		}
+	}
+	jag_flush_put(jpeg_rec->xpos+r->left, jpeg_rec->ypos+r->top, cw, ch, mcu, FALSE);
+	return(1);
+}
+
+
+
+// JPEG compression. A JPEG TJpgDec can not handle is logged and skipped, the stream is still in step
+static int tight_jpeg(struct vnc_rect *rec)
+{
+	JDEC		jd;
+	JRESULT		res;
+	int		len  = 0;
+	uint64_t	st   = esp_timer_get_time();
+	uint64_t	swait= vncc_stats.rx_wait_us;
+	uint64_t	slcd = jag_get_stall_us();
+
+	if ((len = tight_compact_length()) < 0)
+		return(-1);
+	jpeg_rec   = rec;
+	jpeg_left  = len;
+	jpeg_rxerr = FALSE;
+	res = jd_prepare(&jd, tight_jpeg_in, jpeg_pool, sizeof(jpeg_pool), NULL);
+	if (res==JDR_OK)
+		res = jd_decomp(&jd, tight_jpeg_out, 0);
+	if (jpeg_rxerr==TRUE)
+		return(-1);
+	if (res!=JDR_OK)
+		ESP_LOGE(TAG,"tight_jpeg() TJpgDec failed %d on %d byte JPEG", res, len);
+	if (jpeg_left > 0 && vncc_rx_skip(jpeg_left) < 0)
+		return(-1);
+
+	vncc_stats.tight_jpeg++;
+	vncc_stats.tight_jpeg_bytes += len;
+	vncc_stats.tight_jpeg_us += (esp_timer_get_time() - st) - (vncc_stats.rx_wait_us - swait) - (jag_get_stall_us() - slcd);
+	return(0);
+}
+
+
+
+// Basic compression, the filter has been read. Returns 0 or -1 on error
+static int tight_basic(struct vnc_rect *rec, int stream, int filter)
+{
+	uint8_t		*p     = NULL;
+	int		ncolours = 0;
+	int		rowlen = 0;
+	int		len    = 0;
+	int		lpb    = 0;								// lines per band
+	int		l      = 0;
+	int		y      = 0;
+	uint16_t	*band  = NULL;
+
+	switch (filter)
+	{
+		case TIGHT_FILTER_COPY:
+			rowlen = rec->width * tpsize;
+			vncc_stats.tight_copy++;
+		break;
+
+		case TIGHT_FILTER_PALETTE:
+			if ((p = vncc_rx_need(1)) == NULL)
+				return(-1);
+			ncolours = *p + 1;
+			vncc_rx_consume(1);
+			if ((p = vncc_rx_need(ncolours*tpsize)) == NULL)			// at most 1024 bytes
+				return(-1);
+			for (l=0;l<ncolours;l++)
+				palette[l] = tight_tpixel(p+(l*tpsize));
+			vncc_rx_consume(ncolours*tpsize);
+			for (;l<256;l++)							// so a bad index is just a wrong colour
+				palette[l] = 0;
+			rowlen = rec->width;
+			if (ncolours==2)
+				rowlen = (rec->width+7) / 8;
+			vncc_stats.tight_palette++;
+		break;
+
+		case TIGHT_FILTER_GRADIENT:
+			rowlen = rec->width * tpsize;
+			vncc_stats.tight_gradient++;
+		break;
+
+		default:
+			ESP_LOGE(TAG,"tight_basic() unknown filter %d", filter);
+			return(-1);
+	}
+	if (rec->width==0 || rec->height==0)							// no pixel data follows, nothing to draw
+		return(0);
+
+	src = tight_rxsrc;
+	if (rowlen * rec->height >= TIGHT_MIN_TO_COMPRESS)
+	{
+		if ((len = tight_compact_length()) < 0)
+			return(-1);
+		cur_tz = &tz[stream];
+		if (vncc_inflate_init(cur_tz) != 0)
+			return(-1);
+		vncc_inflate_begin(cur_tz, len);
+		src = tight_zsrc;
+	}
+	else	vncc_stats.tight_uncompressed++;
+
+	lpb = JAG_FLUSH_PIXELS / rec->width;
+	l = 0;
+	for (y=0;y<rec->height;y++)
+	{
+		if (band==NULL)
+			band = jag_flush_get();
+		if (tight_read(row, rowlen) != 0)
+		{
+			jag_flush_cancel(band);
+			return(-1);
+		}
+		tight_line(filter, rec->width, y, ncolours, &band[l*rec->width]);
+		l++;
+		if (l==lpb || y==rec->height-1)						// band full or last line
+		{
+			jag_flush_put(rec->xpos, rec->ypos+y+1-l, rec->width, l, band, FALSE);
+			band = NULL;
+			l = 0;
+		}
+	}
+	if (src.need==tight_zneed)
+		return(vncc_inflate_end(cur_tz));
+	return(0);
+}
+
+
+
+int vncc_decode_tight(struct vnc_rect *rec)
+{
+	uint8_t		*p    = NULL;
+	uint8_t		cc    = 0;								// compression control
+	int		filter= TIGHT_FILTER_COPY;
+	int		i     = 0;
+
+	tpsize = vncc_bpp;
+	if (vncc_si.pf_truecolor!=0 && vncc_si.pf_bpp==32 && vncc_si.pf_depth==24 &&
+	    vncc_si.pf_maxred==255 && vncc_si.pf_maxgreen==255 && vncc_si.pf_maxblue==255)
+		tpsize = 3;
+	else if (vncc_si.pf_bpp==32 && (vncc_si.pf_maxred>255 || vncc_si.pf_maxgreen>255 || vncc_si.pf_maxblue>255))
+	{
+		ESP_LOGE(TAG,"vncc_decode_tight() channels wider than 8 bits not supported");
+		return(-1);
+	}
+	else if (vncc_si.pf_bpp!=16 && vncc_si.pf_bpp!=8 && vncc_si.pf_bpp!=32)
+	{
+		ESP_LOGE(TAG,"vncc_decode_tight() %d bit pixels not supported", vncc_si.pf_bpp);
+		return(-1);
+	}
+	if (rec->width > TIGHT_MAXWIDTH)
+		return(-1);
+
+	if ((p = vncc_rx_need(1)) == NULL)
+		return(-1);
+	cc = *p;
+	vncc_rx_consume(1);
+	for (i=0;i<TIGHT_STREAMS;i++)
+	{
+		if ((cc & (1<<i)) != 0)
+		{
+			vncc_inflate_reset(&tz[i]);
+			vncc_stats.tight_resets++;
+		}
+	}
+	cc = cc >> 4;
+
+	if (cc==TIGHT_FILL)
+	{
+		if ((p = vncc_rx_need(tpsize)) == NULL)
+			return(-1);
+		jag_flush_fill(rec->xpos, rec->ypos, rec->width, rec->height, tight_tpixel(p));
+		vncc_rx_consume(tpsize);
+		vncc_stats.tight_fill++;
+		return(0);
+	}
+	if (cc==TIGHT_JPEG)
+	{
+		if (tight_jpeg(rec) != 0)
+			goto fail;
+		return(0);
+	}
+	if (cc > TIGHT_JPEG)
+	{
+		ESP_LOGE(TAG,"vncc_decode_tight() compression %d not supported", cc);
+		goto fail;
+	}
+
+	if ((cc & TIGHT_EXPLICIT_FILTER) != 0)
+	{
+		if ((p = vncc_rx_need(1)) == NULL)
+			return(-1);
+		filter = *p;
+		vncc_rx_consume(1);
+	}
+	if (tight_basic(rec, cc & 3, filter) != 0)
+		goto fail;
+	return(0);
+
+fail:
+	vncc_shutdown();									// lengths are inside the data, it cannot be resynced
+	return(-1);										// and a broken zlib stream stays broken
+}
+
+
+
+// Forget the streams, called before a new connection is made
+void vncc_tight_free()
+{
+	int	i = 0;
+
+	for (i=0;i<TIGHT_STREAMS;i++)
+		vncc_inflate_free(&tz[i]);
+}
@@ -0,0 +1,383 @@
+/*
+ * vncc_tile.c
+ * Palette and RLE tile kernels shared by the TRLE and ZRLE decoders (vncc)
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+/*
+	TRLE (RFC 6143 7.7.5) and ZRLE (7.7.6) tiles are the same apart from their size, where the
+	bytes come from and TRLE being allowed to reuse the last palette.  Each tile starts with a
+	subencoding byte:
+		0		raw CPIXELs
+		1		solid, one CPIXEL
+		2-16		packed palette, that many CPIXELs then 1,2 or 4 bit indexes, rows byte padded
+		127		packed palette using the previous palette (TRLE)
+		128		plain RLE, runs of CPIXEL + length
+		129		palette RLE using the previous palette (TRLE)
+		130-255		palette RLE, (n-128) CPIXELs then runs of index, index with top bit set + length
+
+	The kernels expand straight into an RGB565 tile buffer, tiles are never bigger than 64x64.
+	The palette always has 128 entries so a bad packed index draws the wrong colour rather than
+	costing a check per pixel.
+
+	A CPIXEL is the server pixel, except 32 bit true colour pixels with a depth of 24 or less
+	are sent as just the 3 bytes holding the colour.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "lcd_vncc.h"
+#include "vncc_stats.h"
+#include "vncc_tile.h"
+#include "vncc_decode.h"
+
+extern const char	*TAG;
+
+
+
+// One CPIXEL to the RGB565 value jag draws
+static inline uint16_t tile_cpixel(struct vncc_tile_state *ts, const uint8_t *p)
+{
+	uint32_t	v = 0;
+
+	if (ts->cpsize==vncc_bpp)								// the normal case, RGB565 server
+		return(vncc_pixel(p));
+	if (vncc_si.pf_bigendian!=0)
+		v = (p[0]<<16) | (p[1]<<8) | p[2];
+	else	v = p[0] | (p[1]<<8) | (p[2]<<16);
+	return(vncc_pixel32(v << ts->cpshift));						// shifts from vncc_pf32, scaled only if narrow
+}
+
+
+
+// Run lengths are 1 + the sum of bytes up to and including the first that is not 255
+static int tile_run_length(struct vncc_tile_state *ts)
+{
+	uint8_t		*p   = NULL;
+	uint8_t		b    = 0;
+	int		len  = 1;
+
+	do
+	{
+		if ((p = ts->src.need(1)) == NULL)
+			return(-1);
+		b = *p;
+		len = len + b;
+		ts->src.consume(1);
+	} while (b==255);
+	return(len);
+}
+
+
+
+// Start a rectangle, works out the CPIXEL size from the server pixel format. Returns 0 or -1 if not supported
+int vncc_tile_begin(struct vncc_tile_state *ts, struct vncc_tile_src *src, struct vncc_tile_stats *stats, int reuse)
+{
+	uint32_t	mask = 0;
+
+	ts->src          = *src;
+	ts->stats        = stats;
+	ts->reuse        = reuse;
+	ts->palette_size = 0;
+	ts->cpsize       = vncc_si.pf_bpp / 8;
+	ts->cpshift      = 0;
+	if (vncc_si.pf_truecolor!=0 && vncc_si.pf_bpp==32 && vncc_si.pf_depth<=24)
+	{
+		mask = (vncc_si.pf_maxred << vncc_si.pf_shiftred) | (vncc_si.pf_maxgreen << vncc_si.pf_shiftgreen) |
+			(vncc_si.pf_maxblue << vncc_si.pf_shiftblue);
+		if ((mask & 0xFF000000) == 0)							// colour in the low 3 bytes
+			ts->cpsize = 3;
+		else if ((mask & 0x000000FF) == 0)						// colour in the high 3 bytes
+		{
+			ts->cpsize  = 3;
+			ts->cpshift = 8;
+		}
+	}
+	if (ts->cpsize!=vncc_bpp && ts->cpsize!=3)
+	{
+		ESP_LOGE(TAG,"vncc_tile_begin() %d bit pixels not supported", vncc_si.pf_bpp);
+		return(-1);
+	}
+	return(0);
+}
+
+
+
+// Read n CPIXELs into pal[]
+int vncc_tile_read_palette(struct vncc_tile_state *ts, uint16_t *pal, int n)
+{
+	uint8_t		*p = NULL;
+	int		i  = 0;
+
+	for (i=0;i<n;i++)
+	{
+		if ((p = ts->src.need(ts->cpsize)) == NULL)
+			return(-1);
+		pal[i] = tile_cpixel(ts, p);
+		ts->src.consume(ts->cpsize);
+	}
+	return(0);
+}
+
+
+
+// Raw CPIXELs, a row at a time (at most 192 bytes)
+int vncc_tile_raw(struct vncc_tile_state *ts, uint16_t *tile, int tw, int th)
+{
+	uint8_t		*p = NULL;
+	int		x, y;
+
+	for (y=0;y<th;y++)
+	{
+		if ((p = ts->src.need(tw*ts->cpsize)) == NULL)
+			return(-1);
+		if (ts->cpsize==vncc_bpp)
+		{
+			for (x=0;x<tw;x++)
+			{
+				*tile++ = vncc_pixel(p);
+				p = p + vncc_bpp;
+			}
+		}
+		else
+		{
+			for (x=0;x<tw;x++)
+			{
+				*tile++ = tile_cpixel(ts, p);
+				p = p + ts->cpsize;
+			}
+		}
+		ts->src.consume(tw*ts->cpsize);
+	}
+	return(0);
+}
+
+
+
+// Packed palette indexes, n palette entries gives 1, 2 or 4 bits per pixel, each row starts on a byte
+int vncc_tile_packed(struct vncc_tile_state *ts, uint16_t *tile, int tw, int th, const uint16_t *pal, int n)
+{
+	uint8_t		*p = NULL;
+	uint8_t		b  = 0;
+	int		bits   = 4;
+	int		rowlen = 0;
+	int		x, y, i;
+
+	if (n==2)
+		bits = 1;
+	else if (n<=4)
+		bits = 2;
+	rowlen = ((tw*bits)+7) / 8;
+	for (y=0;y<th;y++)
+	{
+		if ((p = ts->src.need(rowlen)) == NULL)
+			return(-1);
+		x = 0;
+		switch (bits)
+		{
+			case 1:
+				for (;x+8<=tw;x=x+8)
+				{
+					b = *p++;
+					for (i=7;i>=0;i--)
+						*tile++ = pal[(b>>i) & 1];
+				}
+			break;
+
+			case 2:
+				for (;x+4<=tw;x=x+4)
+				{
+					b = *p++;
+					*tile++ = pal[b>>6];
+					*tile++ = pal[(b>>4) & 3];
+					*tile++ = pal[(b>>2) & 3];
+					*tile++ = pal[b & 3];
+				}
+			break;
+
+			case 4:
+				for (;x+2<=tw;x=x+2)
+				{
+					b = *p++;
+					*tile++ = pal[b>>4];
+					*tile++ = pal[b & 15];
+				}
+			break;
+		}
+		if (x<tw)									// part of a byte left at the end of the row
+		{
+			b = *p;
+			for (i=8-bits;x<tw;x++,i=i-bits)
+				*tile++ = pal[(b>>i) & ((1<<bits)-1)];
+		}
+		ts->src.consume(rowlen);
+	}
+	return(0);
+}
+
+
+
+// Plain RLE, count pixels as runs of CPIXEL + length
+int vncc_tile_rle(struct vncc_tile_state *ts, uint16_t *tile, int count)
+{
+	uint16_t	c   = 0;
+	int		len = 0;
+
+	while (count>0)
+	{
+		if (vncc_tile_read_palette(ts, &c, 1) != 0)
+			return(-1);
+		if ((len = tile_run_length(ts)) < 0)
+			return(-1);
+		if (len > count)
+		{
+			ESP_LOGE(TAG,"vncc_tile_rle() run of %d overflows tile by %d", len, len-count);
+			return(-1);
+		}
+		count = count - len;
+		while (len-- > 0)
+			*tile++ = c;
+	}
+	return(0);
+}
+
+
+
+// Palette RLE, count pixels as single indexes or indexes with the top bit set followed by a length
+int vncc_tile_palette_rle(struct vncc_tile_state *ts, uint16_t *tile, int count, const uint16_t *pal)
+{
+	uint8_t		*p  = NULL;
+	uint8_t		b   = 0;
+	uint16_t	c   = 0;
+	int		len = 0;
+
+	while (count>0)
+	{
+		if ((p = ts->src.need(1)) == NULL)
+			return(-1);
+		b = *p;
+		ts->src.consume(1);
+		c = pal[b & 127];
+		if ((b & 128) == 0)								// single pixel
+		{
+			*tile++ = c;
+			count--;
+			continue;
+		}
+		if ((len = tile_run_length(ts)) < 0)
+			return(-1);
+		if (len > count)
+		{
+			ESP_LOGE(TAG,"vncc_tile_palette_rle() run of %d overflows tile by %d", len, len-count);
+			return(-1);
+		}
+		count = count - len;
+		while (len-- > 0)
+			*tile++ = c;
+	}
+	return(0);
+}
+
+
+
+// Decode one tile of tw x th pixels into tile[], counts it and times it (network waits excluded)
+int vncc_tile_decode(struct vncc_tile_state *ts, uint16_t *tile, int tw, int th)
+{
+	struct vncc_tile_stats	*s = ts->stats;
+	uint8_t		*p    = NULL;
+	uint8_t		sub   = 0;
+	uint16_t	c     = 0;
+	uint64_t	st    = 0;
+	uint64_t	swait = 0;
+	uint32_t	us    = 0;
+	int		err   = 0;
+	int		i     = 0;
+
+	st = esp_timer_get_time();
+	swait = vncc_stats.rx_wait_us;
+	if ((p = ts->src.need(1)) == NULL)
+		return(-1);
+	sub = *p;
+	ts->src.consume(1);
+
+	if (sub==0)
+	{
+		err = vncc_tile_raw(ts, tile, tw, th);
+		s->raw++;
+	}
+	else if (sub==1)
+	{
+		err = vncc_tile_read_palette(ts, &c, 1);
+		for (i=0;i<tw*th;i++)
+			tile[i] = c;
+		s->solid++;
+	}
+	else if (sub<=16 || sub==127)
+	{
+		if (sub!=127)
+		{
+			ts->palette_size = sub;
+			err = vncc_tile_read_palette(ts, ts->palette, sub);
+		}
+		else if (ts->reuse==FALSE || ts->palette_size<2 || ts->palette_size>16)
+		{
+			ESP_LOGE(TAG,"vncc_tile_decode() no packed palette to reuse");
+			return(-1);
+		}
+		if (err==0)
+			err = vncc_tile_packed(ts, tile, tw, th, ts->palette, ts->palette_size);
+		s->palette++;
+	}
+	else if (sub==128)
+	{
+		err = vncc_tile_rle(ts, tile, tw*th);
+		s->rle++;
+	}
+	else if (sub>=129)
+	{
+		if (sub!=129)
+		{
+			ts->palette_size = sub-128;
+			err = vncc_tile_read_palette(ts, ts->palette, sub-128);
+		}
+		else if (ts->reuse==FALSE || ts->palette_size<2)
+		{
+			ESP_LOGE(TAG,"vncc_tile_decode() no palette to reuse");
+			return(-1);
+		}
+		if (err==0)
+			err = vncc_tile_palette_rle(ts, tile, tw*th, ts->palette);
+		s->rle++;
+	}
+	else
+	{
+		ESP_LOGE(TAG,"vncc_tile_decode() bad subencoding %d", sub);
+		return(-1);
+	}
+	if (err!=0)
+		return(-1);
+
+	us = (uint32_t)(esp_timer_get_time() - st - (vncc_stats.rx_wait_us - swait));
+	s->tiles++;
+	s->us += us;
+	if (us > s->max_us)
+		s->max_us = us;
+	return(0);
+}
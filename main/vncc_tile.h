@@ -0,0 +1,51 @@
+/*
+ * vncc_tile.h
+ * Palette and RLE tile kernels shared by the TRLE and ZRLE decoders (vncc)
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+#define VNCC_TILE_PALETTE			128					// palette entries, any 7 bit index is safe to look up
+
+
+// Where a decoder gets tile bytes from, the receive buffer for TRLE or a zlib stream for ZRLE.
+// need() returns a pointer to the next n bytes (n <= 256) or NULL on error, consume() uses them
+struct vncc_tile_src
+{
+	uint8_t*	(*need)(int n);
+	void		(*consume)(int n);
+};
+
+
+// Everything about one rectangles tiles that carries from one tile to the next
+struct vncc_tile_state
+{
+	struct vncc_tile_src	src;
+	struct vncc_tile_stats	*stats;								// counters to update, in vncc_stats
+	int			reuse;								// TRUE if subencodings 127 and 129 (TRLE only) are allowed
+	int			cpsize;								// bytes per CPIXEL
+	int			cpshift;							// 3 byte CPIXEL is the top 3 bytes of the pixel
+	int			palette_size;							// entries in palette[] from the last palette tile
+	uint16_t		palette[VNCC_TILE_PALETTE];
+};
+
+
+// Prototypes
+int	 vncc_tile_begin(struct vncc_tile_state *ts, struct vncc_tile_src *src, struct vncc_tile_stats *stats, int reuse);
+int	 vncc_tile_decode(struct vncc_tile_state *ts, uint16_t *tile, int tw, int th);
+int	 vncc_tile_read_palette(struct vncc_tile_state *ts, uint16_t *pal, int n);
+int	 vncc_tile_raw(struct vncc_tile_state *ts, uint16_t *tile, int tw, int th);
+int	 vncc_tile_packed(struct vncc_tile_state *ts, uint16_t *tile, int tw, int th, const uint16_t *pal, int n);
+int	 vncc_tile_rle(struct vncc_tile_state *ts, uint16_t *tile, int count);
+int	 vncc_tile_palette_rle(struct vncc_tile_state *ts, uint16_t *tile, int count, const uint16_t *pal);
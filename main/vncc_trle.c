@@ -0,0 +1,83 @@
+/*
+ * vncc_trle.c
+ * TRLE encoding (15) for the VNC client (vncc)
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+/*
+	The rectangle is sent as 16x16 tiles, left to right then top to bottom, the last row and
+	column may be smaller, RFC 6143 7.7.5.  Tiles are read straight from the receive buffer and
+	decoded by the kernels in vncc_tile.c, the palette carries from one tile to the next so
+	subencodings 127 and 129 can reuse it.
+
+	No zlib, so it costs much less CPU than ZRLE while still sending far fewer bytes than RAW
+	for anything that is not a photo.  Each tile is decoded into a flush buffer and queued for
+	the LCD, so the next tile is decoded while it is sent.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include "screen_driver.h"
+#include "lcd_vncc.h"
+#include "jag.h"
+#include "vncc_rx.h"
+#include "vncc_stats.h"
+#include "vncc_tile.h"
+#include "vncc_decode.h"
+
+#define TRLE_SIZE			16
+
+extern const char	*TAG;
+
+static struct vncc_tile_state	ts;
+static struct vncc_tile_src	trle_src = { vncc_rx_need, vncc_rx_consume };
+
+
+
+int vncc_decode_trle(struct vnc_rect *rec)
+{
+	int		tx = 0;
+	int		ty = 0;
+	int		tw = 0;
+	int		th = 0;
+	uint16_t	*tile = NULL;
+
+	if (vncc_tile_begin(&ts, &trle_src, &vncc_stats.trle, TRUE) != 0)
+		return(-1);
+	for (ty=0;ty<rec->height;ty=ty+TRLE_SIZE)
+	{
+		th = rec->height-ty;
+		if (th > TRLE_SIZE)
+			th = TRLE_SIZE;
+		for (tx=0;tx<rec->width;tx=tx+TRLE_SIZE)
+		{
+			tw = rec->width-tx;
+			if (tw > TRLE_SIZE)
+				tw = TRLE_SIZE;
+			tile = jag_flush_get();
+			if (vncc_tile_decode(&ts, tile, tw, th) != 0)
+			{
+				jag_flush_cancel(tile);
+				return(-1);
+			}
+			jag_flush_put(rec->xpos+tx, rec->ypos+ty, tw, th, tile, FALSE);
+		}
+	}
+	return(0);
+}
@@ -0,0 +1,127 @@
+/*
+ * vncc_zrle.c
+ * ZRLE encoding (16) for the VNC client (vncc)
+ *
+ * Copyright (c) 2021 Jonathan Andrews. All rights reserved.
+ * This file is part of ESPVNCC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+
+/*
+	The rectangle is a 4 byte length followed by that many bytes of zlib data, RFC 6143 7.7.6.
+	Inflated it is 64x64 tiles, left to right then top to bottom, the last row and column may
+	be smaller.  The tiles are TRLE tiles without palette reuse and are decoded by the kernels
+	in vncc_tile.c.
+
+	The zlib stream lasts the whole connection (vncc_inflate.c), it is never fully inflated in
+	RAM, tiles are decoded straight out of the inflate window a few bytes at a time.  Each tile
+	is built in a flush buffer (jag_flush_get) and queued for the LCD as one transfer, the next
+	tile is inflated while it is sent.
+	A bad tile or a tinfl error hangs up, what follows in the stream depends on what was lost.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp32/rom/miniz.h"
+
+#include "screen_driver.h"
+#include "lcd_vncc.h"
+#include "jag.h"
+#include "vncc_rx.h"
+#include "vncc_stats.h"
+#include "vncc_inflate.h"
+#include "vncc_tile.h"
+#include "vncc_decode.h"
+
+#define ZRLE_SIZE			64
+
+extern const char	*TAG;
+
+static struct vncc_inflate	zs;								// the connections zlib stream
+static struct vncc_tile_state	ts;
+
+
+
+// Tile bytes come from the zlib stream
+static uint8_t* zrle_need(int n)
+{
+	return(vncc_inflate_need(&zs, n));
+}
+
+static void zrle_consume(int n)
+{
+	vncc_inflate_consume(&zs, n);
+}
+
+static struct vncc_tile_src	zrle_src = { zrle_need, zrle_consume };
+
+
+
+int vncc_decode_zrle(struct vnc_rect *rec)
+{
+	uint8_t		*p   = NULL;
+	uint32_t	len  = 0;
+	int		tx = 0;
+	int		ty = 0;
+	int		tw = 0;
+	int		th = 0;
+	uint16_t	*tile = NULL;
+
+	if ((p = vncc_rx_need(4)) == NULL)
+		return(-1);
+	len = vncc_be32(p);
+	vncc_rx_consume(4);
+	if (vncc_inflate_init(&zs) != 0)
+		goto fail;
+	if (vncc_tile_begin(&ts, &zrle_src, &vncc_stats.zrle, FALSE) != 0)
+		goto fail;
+	vncc_inflate_begin(&zs, len);
+
+	for (ty=0;ty<rec->height;ty=ty+ZRLE_SIZE)
+	{
+		th = rec->height-ty;
+		if (th > ZRLE_SIZE)
+			th = ZRLE_SIZE;
+		for (tx=0;tx<rec->width;tx=tx+ZRLE_SIZE)
+		{
+			tw = rec->width-tx;
+			if (tw > ZRLE_SIZE)
+				tw = ZRLE_SIZE;
+			tile = jag_flush_get();
+			if (vncc_tile_decode(&ts, tile, tw, th) != 0)
+			{
+				jag_flush_cancel(tile);
+				goto fail;
+			}
+			jag_flush_put(rec->xpos+tx, rec->ypos+ty, tw, th, tile, FALSE);
+		}
+	}
+
+	if (vncc_inflate_end(&zs) != 0)
+		goto fail;
+	return(0);
+
+fail:
+	vncc_shutdown();									// the stream carries on from here, it cannot be resynced
+	return(-1);
+}
+
+
+
+// Forget the stream, called before a new connection is made
+void vncc_zrle_free()
+{
+	vncc_inflate_free(&zs);
+}